@@ -15,7 +15,7 @@ static const char* mqttPass="mqtt";
 static const char* ssid = "xxx";
 static const char* password="xxx";
 
-//DEBUG
+//DEBUG - build with MITSU_TRACE_LEVEL set to get anything here
 static const char* mqttDebugTopic="home/bed3ac/debug";
 static const char* mqttDebugPacketTopic="home/bed3ac/debug/packet";
 void debug(const char* msg){
@@ -74,6 +74,13 @@ void mqttCallback(char* topic, byte* payload, unsigned int length){
     ac.putSettingsJson(str);
 };
 
+void publishSettings(uint16_t changes){
+  char settings[256];
+  if (ac.getSettingsJson(settings, sizeof(settings))){
+    mqttClient.publish(mqttStateTopic, settings, true);
+  }
+}
+
 void setup() {
   // Connect to a/c unit
   ac.initialize();
@@ -81,11 +88,9 @@ void setup() {
   // Set up the MQTT client
   mqttClient.setServer(mqttServer, 1883);
   mqttClient.setCallback(mqttCallback);
-  ac.setDebugCb(&debug); //DEBUG
+  ac.setChangeCb(&publishSettings);
 }
 
-char lastSettings[256];
-
 void loop() {
   if (WiFi.status() != WL_CONNECTED){
     wifiConnect();
@@ -96,14 +101,9 @@ void loop() {
   mqttClient.loop();
 
   ac.monitor();
+#if MITSU_TRACE_LEVEL > MITSU_TRACE_OFF
+  MitsuTrace::drain(&debug); //DEBUG
+#endif
 
-  char newSettings[256] = {0};
-  ac.getSettingsJson(newSettings);
-  
-  if (strcmp(lastSettings,newSettings) != 0){
-    mqttClient.publish(mqttStateTopic, newSettings, true);
-    strcpy(lastSettings, newSettings);
-  }
-  
   delay(20);
 }
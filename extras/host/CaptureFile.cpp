@@ -0,0 +1,251 @@
+/*
+  CaptureFile.cpp - Capture files and replay for the host build
+  Copyright (c) 2017 Jarrod Lamb.  All right reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <thread>
+#include "CaptureFile.h"
+
+/* CaptureWriter */
+
+CaptureWriter::CaptureWriter() : file(NULL) {
+}
+
+CaptureWriter::~CaptureWriter() {
+    close();
+}
+
+bool CaptureWriter::open(const char* path){
+    close();
+    file = fopen(path, "wb");
+    if (!file){
+        return false;
+    }
+    uint8_t header[MitsuCapture::FILE_HEADER_LEN];
+    size_t len = MitsuCapture::writeFileHeader(header);
+    return fwrite(header, 1, len, file) == len;
+}
+
+void CaptureWriter::close(){
+    if (file){
+        fclose(file);
+        file = NULL;
+    }
+}
+
+size_t CaptureWriter::drain(MitsuCapture* capture){
+    MitsuCapture::record_t rec;
+    uint8_t buf[MitsuCapture::MAX_RECORD_LEN];
+    size_t n = 0;
+    while (capture->pop(&rec)){
+        if (file){
+            fwrite(buf, 1, MitsuCapture::encode(rec, buf), file);
+        }
+        n++;
+    }
+    return n;
+}
+
+/* CaptureReader */
+
+CaptureReader::CaptureReader() : data(NULL), length(0), offset(0) {
+}
+
+CaptureReader::~CaptureReader() {
+    close();
+}
+
+bool CaptureReader::open(const char* path){
+    close();
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0){
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < MitsuCapture::FILE_HEADER_LEN){
+        ::close(fd);
+        return false;
+    }
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED){
+        return false;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    data = static_cast<const uint8_t*>(map);
+    length = st.st_size;
+    if (!MitsuCapture::checkFileHeader(data, length)){
+        close();
+        return false;
+    }
+    rewind();
+    return true;
+}
+
+void CaptureReader::close(){
+    if (data){
+        munmap(const_cast<uint8_t*>(data), length);
+        data = NULL;
+        length = 0;
+    }
+}
+
+bool CaptureReader::next(MitsuCapture::record_t* rec){
+    if (!data){
+        return false;
+    }
+    size_t used = MitsuCapture::decode(data + offset, length - offset, rec);
+    offset += used;
+    return used > 0;
+}
+
+void CaptureReader::rewind(){
+    offset = MitsuCapture::FILE_HEADER_LEN;
+}
+
+/* Replay */
+
+static double secondsSince(std::chrono::steady_clock::time_point start){
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void beginStats(CaptureReader* reader, replayStats_t* stats){
+    memset(stats, 0, sizeof(*stats));
+    reader->rewind();
+}
+
+void replayDecoder(CaptureReader* reader, MitsuProtocol::packetBuilder* pb, replayStats_t* stats){
+    static const int MAX_MSGS = MitsuCapture::MAX_DATA_LEN / MitsuProtocol::packetBuilder::MIN_PACKET_LEN + 1;
+    MitsuProtocol::msg_t msgs[MAX_MSGS];
+    MitsuCapture::record_t rec;
+    uint32_t firstMs = 0;
+
+    beginStats(reader, stats);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    while (reader->next(&rec)){
+        if (stats->records++ == 0){
+            firstMs = rec.timeMs;
+        }
+        stats->capturedMs = rec.timeMs - firstMs;
+        if (rec.dir != MitsuCapture::rx){
+            continue;
+        }
+        stats->rxBytes += rec.len;
+
+        size_t offset = 0;
+        while (offset < rec.len){
+            size_t consumed = 0;
+            size_t found = pb->addBytes(rec.data + offset, rec.len - offset, msgs, MAX_MSGS, &consumed);
+            for (size_t i = 0; i < found; i++){
+                stats->frames++;
+                if (msgs[i].msgKindValid){
+                    stats->frameKinds[msgs[i].kind & 0xff]++;
+                }
+            }
+            offset += consumed;
+        }
+    }
+    stats->elapsedSec = secondsSince(start);
+}
+
+// Good frames the controller has decoded so far
+static unsigned long framesDecoded(MitsuAcBase* ac){
+    MitsuAcBase::stats_t s;
+    ac->getStats(&s);
+    unsigned long frames = 0;
+    for (int k = 0; k < MitsuProtocol::MSG_KIND_COUNT; k++){
+        frames += s.rx.frames[k];
+    }
+    return frames;
+}
+
+// Bring the controller up to the time of the next record, running it at
+// each deadline on the way
+static void advanceTo(VirtualMitsuAc* ac, HardwareSerial* serial, unsigned long timeMs, bool first){
+    uint8_t discard[64];
+    if (!first){
+        unsigned long t = ac->getNextDeadline();
+        while ((long)(t - timeMs) < 0){
+            VirtualClock::set(t);
+            ac->monitor();
+            while (serial->peerRead(discard, sizeof(discard)) > 0){
+            }
+            unsigned long next = ac->getNextDeadline();
+            t = ((long)(next - t) > 0) ? next : t + 1;
+        }
+    }
+    VirtualClock::set(timeMs);
+}
+
+static void advanceTo(MitsuAc*, HardwareSerial*, unsigned long, bool){
+}
+
+template <typename Ac>
+static void replay(CaptureReader* reader, Ac* ac, HardwareSerial* serial, bool wallClock, replayStats_t* stats){
+    MitsuCapture::record_t rec;
+    uint8_t discard[64];
+    uint32_t firstMs = 0;
+
+    beginStats(reader, stats);
+    unsigned long framesBefore = framesDecoded(ac);
+    // Capture times are made relative, so repeats carry on from the clock
+    unsigned long origin = VirtualClock::now();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    while (reader->next(&rec)){
+        bool first = (stats->records++ == 0);
+        if (first){
+            firstMs = rec.timeMs;
+        }
+        stats->capturedMs = rec.timeMs - firstMs;
+        if (rec.dir != MitsuCapture::rx){
+            continue;
+        }
+
+        if (wallClock){
+            std::chrono::milliseconds due(rec.timeMs - firstMs);
+            std::this_thread::sleep_until(start + due);
+        }else{
+            advanceTo(ac, serial, origin + (rec.timeMs - firstMs), first);
+        }
+
+        stats->rxBytes += rec.len;
+        serial->peerWrite(rec.data, rec.len);
+        ac->monitor();
+
+        // The controller's own requests go nowhere
+        while (serial->peerRead(discard, sizeof(discard)) > 0){
+        }
+    }
+    stats->frames = framesDecoded(ac) - framesBefore;
+    stats->elapsedSec = secondsSince(start);
+}
+
+void replayController(CaptureReader* reader, VirtualMitsuAc* ac, HardwareSerial* serial, replayStats_t* stats){
+    replay(reader, ac, serial, false, stats);
+}
+
+void replayController(CaptureReader* reader, MitsuAc* ac, HardwareSerial* serial, replayStats_t* stats){
+    replay(reader, ac, serial, true, stats);
+}
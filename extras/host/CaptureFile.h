@@ -0,0 +1,93 @@
+/*
+  CaptureFile.h - Capture files and replay for the host build
+  Copyright (c) 2017 Jarrod Lamb.  All right reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef __CaptureFile_H__
+#define __CaptureFile_H__
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "MitsuCapture.h"
+#include "MitsuAc.h"
+#include "VirtualClock.h"
+
+/*
+CaptureWriter Class -
+Appends the records of a MitsuCapture ring to a capture file.
+*/
+class CaptureWriter
+{
+  public:
+    CaptureWriter();
+    ~CaptureWriter();
+
+    bool open(const char* path);
+    void close();
+
+    // Move every record out of capture into the file, returns the count
+    size_t drain(MitsuCapture* capture);
+
+  private:
+    FILE* file;
+};
+
+/*
+CaptureReader Class -
+Memory maps a capture file and walks its records in order.
+*/
+class CaptureReader
+{
+  public:
+    CaptureReader();
+    ~CaptureReader();
+
+    bool open(const char* path);
+    void close();
+
+    // Next record, false at the end or on a truncated record
+    bool next(MitsuCapture::record_t* rec);
+    void rewind();
+    size_t size() const { return length; }
+
+  private:
+    const uint8_t* data;
+    size_t length;
+    size_t offset;
+};
+
+/*
+CaptureReplay -
+Drives the library from a capture, either just the decoder or a whole
+controller over a host serial port. Wall clock replay keeps the gaps
+between records, otherwise records go in as fast as they are decoded
+and the controller runs on a VirtualClock following the capture's
+timestamps, so its polls and timeouts fall as they would have.
+*/
+struct replayStats_t {
+    unsigned long records;
+    unsigned long rxBytes;
+    unsigned long frames;
+    unsigned long frameKinds[256];
+    uint32_t capturedMs; // Time spanned by the capture
+    double elapsedSec;   // Time taken to replay it
+};
+
+void replayDecoder(CaptureReader* reader, MitsuProtocol::packetBuilder* pb, replayStats_t* stats);
+typedef MitsuAcT<HardwareSerial, MitsuTiming, VirtualClock> VirtualMitsuAc;
+void replayController(CaptureReader* reader, VirtualMitsuAc* ac, HardwareSerial* serial, replayStats_t* stats);
+void replayController(CaptureReader* reader, MitsuAc* ac, HardwareSerial* serial, replayStats_t* stats);
+#endif
@@ -0,0 +1,249 @@
+/*
+  HeatPumpEmulator.cpp - Software Mitsubishi heat pump for the host build
+  Copyright (c) 2017 Jarrod Lamb.  All right reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <string.h>
+#include "Arduino.h"
+#include "HeatPumpEmulator.h"
+
+// Frame layout, as in MitsuProtocol
+static const int HEADER_LEN   = 5;
+static const int CHECKSUM_LEN = 1;
+static const int MSG_TYPE_POS = 1;
+static const int LENGTH_POS   = 4;
+static const int PAYLOAD_POS  = 5;
+
+static const uint8_t HEADER_1 = 0xfc;
+static const uint8_t HEADER_3 = 0x01;
+static const uint8_t HEADER_4 = 0x30;
+
+static const uint8_t TX_CONNECT         = 0x5a;
+static const uint8_t TX_SETTINGS        = 0x41;
+static const uint8_t TX_INFO_REQUEST    = 0x42;
+static const uint8_t RX_CURRENT_SETTINGS = 0x62;
+static const uint8_t RX_STATUS_OK       = 0x61;
+static const uint8_t RX_CONNECT_OK      = 0x7a;
+static const uint8_t RX_STATUS_NOK      = 0x7a; // the same reply refuses settings
+
+static const uint8_t INFO_SETTINGS  = 0x02;
+static const uint8_t INFO_ROOM_TEMP = 0x03;
+
+static const int DATA_LEN = 0x10;
+
+// 2400 baud 8E1, 11 bits a byte
+static unsigned long wireTime(size_t bytes){
+    return (bytes * 11 * 1000 + 2399) / 2400;
+}
+
+static uint8_t checksum(const uint8_t* data, int len){
+    uint8_t sum = 0;
+    for (int i = 0; i < len; i++){
+        sum += data[i];
+    }
+    return (0xfc - sum) & 0xff;
+}
+
+HeatPumpEmulator::HeatPumpEmulator() {
+    power        = 0x00;     // off
+    mode         = 0x08;     // auto
+    temp         = 31 - 22;  // 22 degC
+    fan          = 0x00;     // auto
+    vane         = 0x00;     // auto
+    wideVane     = 0x03;     // center
+    roomTemp     = 21 - 10;  // 21 degC
+    tempSens1Raw = 128 + 42; // 21.0 degC
+    tempSens2Raw = 128 + 43; // 21.5 degC
+
+    framesReceived = 0;
+    framesSent = 0;
+    badFrames = 0;
+    settingsRefused = 0;
+    bitErrors = 0;
+
+    clock = millis;
+    rxCursor = 0;
+    requestLen = 0;
+    latency = 0;
+    bitErrorRate = 0.0;
+    nokRate = 0.0;
+    seed = 0x2545f491;
+}
+
+void HeatPumpEmulator::setLatency(unsigned long ms){
+    latency = ms;
+}
+
+void HeatPumpEmulator::setBitErrorRate(double rate){
+    bitErrorRate = rate;
+}
+
+void HeatPumpEmulator::setNokRate(double rate){
+    nokRate = rate;
+}
+
+void HeatPumpEmulator::setSeed(uint32_t seed){
+    this->seed = seed ? seed : 1;
+}
+
+void HeatPumpEmulator::setClock(clockFn_t clock){
+    this->clock = clock;
+}
+
+void HeatPumpEmulator::receive(const uint8_t* data, size_t len){
+    for (size_t i = 0; i < len; i++){
+        uint8_t b = data[i];
+        if (rxCursor == 0 && b != HEADER_1){
+            continue;
+        }
+        rxBuffer[rxCursor++] = b;
+
+        if (rxCursor > LENGTH_POS){
+            int frameLen = HEADER_LEN + rxBuffer[LENGTH_POS] + CHECKSUM_LEN;
+            if (frameLen > MAX_SIZE){
+                badFrames++;
+                rxCursor = 0;
+            }else if (rxCursor == frameLen){
+                if (rxBuffer[frameLen - 1] == checksum(rxBuffer, frameLen - 1)){
+                    framesReceived++;
+                    handleFrame(rxBuffer, frameLen);
+                }else{
+                    badFrames++;
+                }
+                rxCursor = 0;
+            }
+        }
+    }
+}
+
+bool HeatPumpEmulator::getNextReplyTime(unsigned long* due){
+    if (replies.empty()){
+        return false;
+    }
+    *due = replies.front().due;
+    return true;
+}
+
+size_t HeatPumpEmulator::transmit(uint8_t* out, size_t maxLen){
+    size_t n = 0;
+    unsigned long now = clock();
+    while (!replies.empty() && (long)(now - replies.front().due) >= 0){
+        reply_t& reply = replies.front();
+        if (n + reply.bytes.size() > maxLen){
+            break;
+        }
+        for (size_t i = 0; i < reply.bytes.size(); i++){
+            uint8_t b = reply.bytes[i];
+            if (bitErrorRate > 0.0){
+                for (int bit = 0; bit < 8; bit++){
+                    if ((random() / 4294967296.0) < bitErrorRate){
+                        b ^= (1 << bit);
+                        bitErrors++;
+                    }
+                }
+            }
+            out[n++] = b;
+        }
+        framesSent++;
+        replies.pop_front();
+    }
+    return n;
+}
+
+void HeatPumpEmulator::service(HardwareSerial* serial){
+    uint8_t buf[64];
+    size_t n;
+    while ((n = serial->peerRead(buf, sizeof(buf))) > 0){
+        receive(buf, n);
+    }
+    while ((n = transmit(buf, sizeof(buf))) > 0){
+        serial->peerWrite(buf, n);
+    }
+}
+
+void HeatPumpEmulator::handleFrame(const uint8_t* frame, int len){
+    uint8_t payload[DATA_LEN] = {0};
+    requestLen = len;
+
+    switch (frame[MSG_TYPE_POS]){
+        case TX_CONNECT:
+            // The unit acknowledges a connect with 0x7a
+            queueReply(RX_CONNECT_OK, payload, 1);
+            break;
+
+        case TX_SETTINGS: {
+            if (nokRate > 0.0 && (random() / 4294967296.0) < nokRate){
+                // Busy, the settings aren't applied
+                settingsRefused++;
+                queueReply(RX_STATUS_NOK, payload, 1);
+                break;
+            }
+            uint8_t control = frame[PAYLOAD_POS + 1];
+            if (control & 0x01){ power    = frame[8]; }
+            if (control & 0x02){ mode     = frame[9]; }
+            if (control & 0x04){ temp     = frame[10]; }
+            if (control & 0x08){ fan      = frame[11]; }
+            if (control & 0x10){ vane     = frame[12]; }
+            if (control & 0x80){ wideVane = frame[15]; }
+            queueReply(RX_STATUS_OK, payload, DATA_LEN);
+            break;
+        }
+
+        case TX_INFO_REQUEST:
+            payload[0] = frame[PAYLOAD_POS];
+            if (payload[0] == INFO_SETTINGS){
+                payload[3]  = power;
+                payload[4]  = mode;
+                payload[5]  = temp;
+                payload[6]  = fan;
+                payload[7]  = vane;
+                payload[10] = wideVane;
+            }else if (payload[0] == INFO_ROOM_TEMP){
+                payload[3] = roomTemp;
+                payload[6] = tempSens1Raw;
+                payload[7] = tempSens2Raw;
+            }
+            queueReply(RX_CURRENT_SETTINGS, payload, DATA_LEN);
+            break;
+
+        default:
+            break; // Not answered by the unit
+    }
+}
+
+void HeatPumpEmulator::queueReply(uint8_t kind, const uint8_t* payload, int payloadLen){
+    // Replies start once the request has fully arrived and are
+    // delivered once their last byte would have
+    reply_t reply;
+    reply.due = clock() + wireTime(requestLen) + latency + wireTime(HEADER_LEN + payloadLen + CHECKSUM_LEN);
+    reply.bytes.reserve(HEADER_LEN + payloadLen + CHECKSUM_LEN);
+    reply.bytes.push_back(HEADER_1);
+    reply.bytes.push_back(kind);
+    reply.bytes.push_back(HEADER_3);
+    reply.bytes.push_back(HEADER_4);
+    reply.bytes.push_back(static_cast<uint8_t>(payloadLen));
+    reply.bytes.insert(reply.bytes.end(), payload, payload + payloadLen);
+    reply.bytes.push_back(checksum(&reply.bytes[0], static_cast<int>(reply.bytes.size())));
+    replies.push_back(reply);
+}
+
+// xorshift32, so runs with the same seed see the same errors
+uint32_t HeatPumpEmulator::random(){
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
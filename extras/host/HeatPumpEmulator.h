@@ -0,0 +1,103 @@
+/*
+  HeatPumpEmulator.h - Software Mitsubishi heat pump for the host build
+  Copyright (c) 2017 Jarrod Lamb.  All right reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef __HeatPumpEmulator_H__
+#define __HeatPumpEmulator_H__
+#include <stdint.h>
+#include <stddef.h>
+#include <deque>
+#include <vector>
+#include "HardwareSerial.h"
+
+/*
+HeatPumpEmulator Class -
+Plays the indoor unit end of the CN105 link. Frames written by the
+controller are fed in with receive(), replies come out of transmit()
+once the wire time of both frames and the latency have elapsed, with
+bit errors applied on the way.
+service() does both against the peer side of a host HardwareSerial.
+*/
+class HeatPumpEmulator
+{
+  public:
+    HeatPumpEmulator();
+
+    // Link behaviour
+    void setLatency(unsigned long ms);
+    void setBitErrorRate(double rate); // probability of each bit flipping
+    void setNokRate(double rate);      // probability of refusing a settings frame
+    void setSeed(uint32_t seed);
+
+    // Where the time comes from, millis() unless set
+    typedef unsigned long (*clockFn_t)();
+    void setClock(clockFn_t clock);
+
+    // Bytes from the controller
+    void receive(const uint8_t* data, size_t len);
+
+    // Bytes for the controller that are due now, returns count written
+    size_t transmit(uint8_t* out, size_t maxLen);
+
+    // When the next reply is due, false if none are queued
+    bool getNextReplyTime(unsigned long* due);
+
+    // Shuttle bytes both ways over a host serial port
+    void service(HardwareSerial* serial);
+
+    // Unit state, encoded as on the wire
+    uint8_t power;
+    uint8_t mode;
+    uint8_t temp;
+    uint8_t fan;
+    uint8_t vane;
+    uint8_t wideVane;
+    uint8_t roomTemp;
+    uint8_t tempSens1Raw;
+    uint8_t tempSens2Raw;
+
+    // Counters
+    unsigned long framesReceived;
+    unsigned long framesSent;
+    unsigned long badFrames;
+    unsigned long settingsRefused;
+    unsigned long bitErrors;
+
+  private:
+    static const int MAX_SIZE = 32;
+
+    struct reply_t {
+        unsigned long due;
+        std::vector<uint8_t> bytes;
+    };
+
+    void handleFrame(const uint8_t* frame, int len);
+    void queueReply(uint8_t kind, const uint8_t* payload, int payloadLen);
+    uint32_t random();
+
+    uint8_t rxBuffer[MAX_SIZE];
+    int rxCursor;
+    int requestLen;
+
+    std::deque<reply_t> replies;
+    clockFn_t clock;
+    unsigned long latency;
+    double bitErrorRate;
+    double nokRate;
+    uint32_t seed;
+};
+#endif
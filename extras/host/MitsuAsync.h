@@ -0,0 +1,341 @@
+/*
+  MitsuAsync.h - C++20 coroutine interface to MitsuAcT for host builds
+  Copyright (c) 2017 Jarrod Lamb.  All right reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef __MitsuAsync_H__
+#define __MitsuAsync_H__
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <utility>
+#include <vector>
+#include "MitsuAc.h"
+
+class MitsuExecutor;
+
+namespace mitsuAsyncDetail {
+
+// What every MitsuTask promise has: who to resume when it finishes, or
+// the executor to tell if nobody is waiting for it
+struct promiseBase {
+    std::coroutine_handle<> continuation;
+    MitsuExecutor* executor = nullptr;
+
+    struct finalAwaiter {
+        bool await_ready() noexcept { return false; }
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept;
+        void await_resume() noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    finalAwaiter final_suspend() noexcept { return {}; }
+    // Nothing in the library throws
+    void unhandled_exception() { std::terminate(); }
+};
+
+template <typename T>
+struct promiseValue : promiseBase {
+    T value{};
+    void return_value(T v) { value = std::move(v); }
+    T result() { return std::move(value); }
+};
+
+template <>
+struct promiseValue<void> : promiseBase {
+    void return_void() {}
+    void result() {}
+};
+
+}
+
+/*
+MitsuTask Class -
+A coroutine returning T. It starts when awaited, resuming the awaiter
+once it returns, or when handed to MitsuExecutor::spawn().
+*/
+template <typename T = void>
+class MitsuTask
+{
+  public:
+    struct promise_type : mitsuAsyncDetail::promiseValue<T> {
+        MitsuTask get_return_object() {
+            return MitsuTask(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+    };
+
+    MitsuTask(MitsuTask&& other) noexcept : h(std::exchange(other.h, nullptr)) {}
+    MitsuTask(const MitsuTask&) = delete;
+    MitsuTask& operator=(const MitsuTask&) = delete;
+    ~MitsuTask() {
+        if (h) {
+            h.destroy();
+        }
+    }
+
+    bool await_ready() noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept {
+        h.promise().continuation = awaiter;
+        return h;
+    }
+    T await_resume() { return h.promise().result(); }
+
+  private:
+    friend class MitsuExecutor;
+    explicit MitsuTask(std::coroutine_handle<promise_type> h) : h(h) {}
+    std::coroutine_handle<promise_type> h;
+};
+
+/*
+MitsuExecutor Class -
+Runs coroutines on the thread that calls run(), normally the loop that
+calls monitor(). Nothing here is thread safe.
+*/
+class MitsuExecutor
+{
+  public:
+    // Start task, it frees itself when it returns
+    template <typename T>
+    void spawn(MitsuTask<T> task) {
+        auto h = std::exchange(task.h, nullptr);
+        h.promise().executor = this;
+        running++;
+        post(h);
+    }
+
+    // Resume h at the next run()
+    void post(std::coroutine_handle<> h) {
+        ready.push_back(h);
+    }
+
+    // Resume everything that's ready, including what becomes ready on the
+    // way. Returns whether anything ran
+    bool run() {
+        bool ran = !ready.empty();
+        while (!ready.empty()) {
+            std::coroutine_handle<> h = ready.front();
+            ready.pop_front();
+            h.resume();
+        }
+        return ran;
+    }
+
+    // Spawned tasks that haven't returned yet
+    int getRunning() const { return running; }
+
+  private:
+    friend struct mitsuAsyncDetail::promiseBase;
+    std::deque<std::coroutine_handle<>> ready;
+    int running = 0;
+};
+
+template <typename Promise>
+std::coroutine_handle<> mitsuAsyncDetail::promiseBase::finalAwaiter::await_suspend(std::coroutine_handle<Promise> h) noexcept {
+    promiseBase& p = h.promise();
+    if (p.continuation) {
+        return p.continuation;
+    }
+    if (p.executor) {
+        // Spawned, nobody owns it
+        p.executor->running--;
+        h.destroy();
+    }
+    return std::noop_coroutine();
+}
+
+/*
+MitsuAsync Class -
+Awaitable operations on one controller. The controller's rx callback
+marks the operations it completes, within monitor(), and their coroutines
+resume at the executor's next run(), so they never re-enter monitor().
+Timeouts and delays are on the controller's Clock.
+
+  MitsuTask<> scene(MitsuAsync<MitsuAcT<PosixSerial>>& async){
+      if (co_await async.apply(settings)){
+          co_await async.refresh(MitsuProtocol::roomTemp);
+      }
+  }
+  executor.spawn(scene(async));
+  ...
+  ac.monitor();
+  async.checkTimeouts();
+  executor.run();
+*/
+template <typename Ac>
+class MitsuAsync
+{
+    typedef typename Ac::clock_t Clock;
+
+  public:
+    // Operations not done within timeout ms finish with false
+    MitsuAsync(Ac* ac, MitsuExecutor* executor, unsigned long timeout = 10000)
+        : ac(ac), executor(executor), timeout(timeout) {
+        ac->setRxCb([this](MitsuProtocol::info_t kind){ rxStored(kind); });
+    }
+    // Operations still waiting finish with false
+    ~MitsuAsync() {
+        ac->setRxCb(nullptr);
+        while (!waiting.empty()) {
+            finish(waiting.size() - 1, false);
+        }
+    }
+    MitsuAsync(const MitsuAsync&) = delete;
+    MitsuAsync& operator=(const MitsuAsync&) = delete;
+
+    class awaiter {
+      public:
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h) {
+            async->start(this, h);
+        }
+        bool await_resume() const noexcept { return result; }
+
+      private:
+        friend class MitsuAsync;
+        enum wait_t { waitApply, waitRefresh, waitDelay };
+        awaiter(MitsuAsync* async, wait_t wait) : async(async), wait(wait) {}
+
+        MitsuAsync* async;
+        wait_t wait;
+        MitsuProtocol::settings_t settings{};
+        MitsuProtocol::info_t kind = MitsuProtocol::settings;
+        unsigned long deadline = 0;
+        std::coroutine_handle<> handle;
+        bool result = false;
+    };
+
+    // Put settings' valid fields to the unit. True once the unit has been
+    // read back with them, and anything put since. False as soon as an
+    // apply() gives any of them other values, or once the unit is read
+    // back at a target without them after a put straight to the controller
+    awaiter apply(const MitsuProtocol::settings_t& settings) {
+        awaiter a(this, awaiter::waitApply);
+        a.settings = settings;
+        return a;
+    }
+
+    // True once an info of kind has been read from the unit, asked for
+    // ahead of the regular polls
+    awaiter refresh(MitsuProtocol::info_t kind) {
+        awaiter a(this, awaiter::waitRefresh);
+        a.kind = kind;
+        return a;
+    }
+
+    // True after ms, on the controller's clock
+    awaiter delay(unsigned long ms) {
+        awaiter a(this, awaiter::waitDelay);
+        a.deadline = ms;
+        return a;
+    }
+
+    // Finish operations whose time is up, call after monitor()
+    void checkTimeouts() {
+        unsigned long now = Clock::now();
+        for (size_t i = 0; i < waiting.size();) {
+            awaiter* a = waiting[i];
+            if ((long)(now - a->deadline) >= 0) {
+                finish(i, a->wait == awaiter::waitDelay);
+            }else{
+                i++;
+            }
+        }
+    }
+
+    // The earliest time checkTimeouts() has something to do, if anything
+    // is waiting
+    bool getNextDeadline(unsigned long* next) {
+        if (waiting.empty()) {
+            return false;
+        }
+        *next = waiting[0]->deadline;
+        for (size_t i = 1; i < waiting.size(); i++) {
+            if ((long)(waiting[i]->deadline - *next) < 0) {
+                *next = waiting[i]->deadline;
+            }
+        }
+        return true;
+    }
+
+  private:
+    void start(awaiter* a, std::coroutine_handle<> h) {
+        a->handle = h;
+        switch (a->wait) {
+            case awaiter::waitApply:
+                supersede(a->settings);
+                ac->putSettings(a->settings);
+                a->deadline = Clock::now() + timeout;
+                break;
+            case awaiter::waitRefresh:
+                ac->requestInfo(a->kind);
+                a->deadline = Clock::now() + timeout;
+                break;
+            case awaiter::waitDelay:
+                a->deadline += Clock::now();
+                break;
+        }
+        waiting.push_back(a);
+    }
+
+    void rxStored(MitsuProtocol::info_t kind) {
+        for (size_t i = 0; i < waiting.size();) {
+            awaiter* a = waiting[i];
+            if (a->wait == awaiter::waitApply && kind == MitsuProtocol::settings && ac->isTargetAchieved()) {
+                // The unit is at the target, which only lacks the awaited
+                // fields if something put to the controller since changed them
+                finish(i, readBack(a->settings));
+            }else if (a->wait == awaiter::waitRefresh && kind == a->kind) {
+                finish(i, true);
+            }else{
+                i++;
+            }
+        }
+    }
+
+    // Whether the unit was last read with settings' fields
+    bool readBack(const MitsuProtocol::settings_t& settings) {
+        MitsuProtocol::settings_t read;
+        MitsuProtocol::roomTemp_t roomTemp;
+        ac->getSettings(&read, &roomTemp);
+        return MitsuProtocol::controlFor(settings, read) == 0;
+    }
+
+    // Applies waiting for other values of fields settings is about to put
+    // can't complete any more
+    void supersede(const MitsuProtocol::settings_t& settings) {
+        for (size_t i = 0; i < waiting.size();) {
+            if (waiting[i]->wait == awaiter::waitApply && MitsuProtocol::diff(waiting[i]->settings, settings) != 0) {
+                finish(i, false);
+            }else{
+                i++;
+            }
+        }
+    }
+
+    void finish(size_t i, bool result) {
+        awaiter* a = waiting[i];
+        waiting.erase(waiting.begin() + i);
+        a->result = result;
+        executor->post(a->handle);
+    }
+
+    Ac* ac;
+    MitsuExecutor* executor;
+    unsigned long timeout;
+    std::vector<awaiter*> waiting;
+};
+#endif
@@ -0,0 +1,89 @@
+/*
+  MpscQueue.h - Bounded lock-free multi producer, single consumer queue
+  Copyright (c) 2017 Jarrod Lamb.  All right reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef __MpscQueue_H__
+#define __MpscQueue_H__
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+/*
+MpscQueue Class -
+A ring of SIZE cells (a power of two), each with a sequence number that
+says whose turn it is. Producers claim a cell by moving the tail on with
+a compare and swap, the consumer owns the head. Neither side ever
+blocks: push() fails when full and pop() when empty.
+*/
+template <typename T, size_t SIZE>
+class MpscQueue
+{
+    static_assert((SIZE & (SIZE - 1)) == 0, "SIZE must be a power of two");
+
+  public:
+    MpscQueue() : tail(0), head(0) {
+        for (size_t i = 0; i < SIZE; i++){
+            cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // Any thread
+    bool push(const T& value){
+        size_t pos = tail.load(std::memory_order_relaxed);
+        cell_t* cell;
+        while (true){
+            cell = &cells[pos & (SIZE - 1)];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0){
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)){
+                    break;
+                }
+            }else if (diff < 0){
+                return false; // Full
+            }else{
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value = value;
+        cell->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // The consumer only
+    bool pop(T* value){
+        cell_t* cell = &cells[head & (SIZE - 1)];
+        if (cell->seq.load(std::memory_order_acquire) != head + 1){
+            return false;
+        }
+        *value = cell->value;
+        cell->seq.store(head + SIZE, std::memory_order_release);
+        head++;
+        return true;
+    }
+
+  private:
+    struct cell_t {
+        std::atomic<size_t> seq;
+        T value;
+    };
+
+    cell_t cells[SIZE];
+    std::atomic<size_t> tail;
+    size_t head;
+};
+#endif
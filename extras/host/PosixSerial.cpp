@@ -0,0 +1,132 @@
+/*
+  PosixSerial.cpp - termios serial transport for the host build
+  Copyright (c) 2017 Jarrod Lamb.  All right reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include "PosixSerial.h"
+
+static speed_t toSpeed(unsigned long baud){
+    switch (baud){
+        case 1200:   return B1200;
+        case 2400:   return B2400;
+        case 4800:   return B4800;
+        case 9600:   return B9600;
+        case 19200:  return B19200;
+        case 38400:  return B38400;
+        case 57600:  return B57600;
+        case 115200: return B115200;
+        default:     return B0;
+    }
+}
+
+PosixSerial::PosixSerial(const char* path) : _fd(-1) {
+    strncpy(_path, path, sizeof(_path) - 1);
+    _path[sizeof(_path) - 1] = '\0';
+}
+
+PosixSerial::~PosixSerial(){
+    end();
+}
+
+void PosixSerial::begin(unsigned long baud, SerialConfig config){
+    end();
+    _fd = open(_path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (_fd < 0){
+        return;
+    }
+
+    struct termios tio;
+    speed_t speed = toSpeed(baud);
+    if (tcgetattr(_fd, &tio) != 0 || speed == B0){
+        end();
+        return;
+    }
+    cfmakeraw(&tio);
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cflag &= ~(CSTOPB | PARODD | CRTSCTS);
+    if (config == SERIAL_8E1){
+        tio.c_cflag |= PARENB;
+        // Check parity and drop bad bytes, INPCK alone passes them on as 0x00
+        tio.c_iflag |= INPCK | IGNPAR;
+        tio.c_iflag &= ~PARMRK;
+    }else{
+        tio.c_cflag &= ~PARENB;
+    }
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+    if (tcsetattr(_fd, TCSANOW, &tio) != 0){
+        end();
+        return;
+    }
+    tcflush(_fd, TCIOFLUSH);
+}
+
+void PosixSerial::end(){
+    if (_fd >= 0){
+        close(_fd);
+        _fd = -1;
+    }
+}
+
+int PosixSerial::available(){
+    int n = 0;
+    if (_fd < 0 || ioctl(_fd, FIONREAD, &n) != 0){
+        return 0;
+    }
+    return n;
+}
+
+int PosixSerial::availableForWrite(){
+    int queued = 0;
+    if (_fd < 0){
+        return 0;
+    }
+    if (ioctl(_fd, TIOCOUTQ, &queued) != 0){
+        queued = 0;
+    }
+    return (queued < TX_BUFFER_SIZE) ? TX_BUFFER_SIZE - queued : 0;
+}
+
+size_t PosixSerial::readBytes(uint8_t* buffer, size_t length){
+    if (_fd < 0){
+        return 0;
+    }
+    ssize_t n = read(_fd, buffer, length);
+    return (n > 0) ? static_cast<size_t>(n) : 0;
+}
+
+size_t PosixSerial::write(const uint8_t* buffer, size_t length){
+    size_t done = 0;
+    while (_fd >= 0 && done < length){
+        ssize_t n = ::write(_fd, buffer + done, length - done);
+        if (n < 0 && errno == EINTR){
+            continue;
+        }
+        if (n <= 0){
+            break; // Full, the rest of the frame is lost like a UART overrun
+        }
+        done += n;
+    }
+    return done;
+}
@@ -0,0 +1,55 @@
+/*
+  PosixSerial.h - termios serial transport for the host build
+  Copyright (c) 2017 Jarrod Lamb.  All right reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef __PosixSerial_H__
+#define __PosixSerial_H__
+#include <stdint.h>
+#include <stddef.h>
+#include "HardwareSerial.h"
+
+/*
+PosixSerial Class -
+A tty (USB-UART adapter, pty...) as a MitsuAcT transport. begin() opens
+it non-blocking and sets it raw at the given baud and framing, nothing
+ever waits, and fd() is there for poll/epoll.
+*/
+class PosixSerial
+{
+  public:
+    PosixSerial(const char* path);
+    ~PosixSerial();
+
+    void begin(unsigned long baud, SerialConfig config = SERIAL_8N1);
+    void end();
+    int available();
+    int availableForWrite();
+    size_t readBytes(uint8_t* buffer, size_t length);
+    size_t write(const uint8_t* buffer, size_t length);
+    operator bool() const { return _fd >= 0; }
+
+    int fd() const { return _fd; }
+    const char* path() const { return _path; }
+
+  private:
+    // Kernel tx buffer assumed when it can't be asked
+    static const int TX_BUFFER_SIZE = 4096;
+
+    char _path[64];
+    int _fd;
+};
+#endif
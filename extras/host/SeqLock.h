@@ -0,0 +1,75 @@
+/*
+  SeqLock.h - Single writer, many reader snapshot
+  Copyright (c) 2017 Jarrod Lamb.  All right reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef __SeqLock_H__
+#define __SeqLock_H__
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+
+/*
+SeqLock Class -
+Holds a copy of a plain T. The writer bumps the sequence to odd, copies
+in and bumps it to even again, readers copy out and retry if the
+sequence was odd or moved meanwhile. The copy is kept as relaxed atomic
+words so a torn read is only ever thrown away, never undefined. Writes
+must come from one thread at a time.
+*/
+template <typename T>
+class SeqLock
+{
+  public:
+    SeqLock() : seq(0) {
+        for (size_t i = 0; i < WORDS; i++){
+            words[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void write(const T& value){
+        uint32_t buf[WORDS] = {0};
+        memcpy(buf, &value, sizeof(T));
+        uint32_t s = seq.load(std::memory_order_relaxed);
+        seq.store(s + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (size_t i = 0; i < WORDS; i++){
+            words[i].store(buf[i], std::memory_order_relaxed);
+        }
+        seq.store(s + 2, std::memory_order_release);
+    }
+
+    void read(T* value) const {
+        uint32_t buf[WORDS];
+        uint32_t before, after;
+        do {
+            before = seq.load(std::memory_order_acquire);
+            for (size_t i = 0; i < WORDS; i++){
+                buf[i] = words[i].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            after = seq.load(std::memory_order_relaxed);
+        } while ((before & 1) || before != after);
+        memcpy(value, buf, sizeof(T));
+    }
+
+  private:
+    static const size_t WORDS = (sizeof(T) + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+
+    std::atomic<uint32_t> seq;
+    std::atomic<uint32_t> words[WORDS];
+};
+#endif
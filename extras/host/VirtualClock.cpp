@@ -0,0 +1,33 @@
+/*
+  VirtualClock.cpp - Simulated time for the host build
+  Copyright (c) 2017 Jarrod Lamb.  All right reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include "VirtualClock.h"
+
+unsigned long VirtualClock::ms = 0;
+
+unsigned long VirtualClock::now(){
+    return ms;
+}
+
+void VirtualClock::set(unsigned long ms){
+    VirtualClock::ms = ms;
+}
+
+void VirtualClock::advance(unsigned long ms){
+    VirtualClock::ms += ms;
+}
@@ -0,0 +1,38 @@
+/*
+  VirtualClock.h - Simulated time for the host build
+  Copyright (c) 2017 Jarrod Lamb.  All right reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef __VirtualClock_H__
+#define __VirtualClock_H__
+
+/*
+VirtualClock Class -
+A clock policy for MitsuAcT (and a clock for HeatPumpEmulator) that only
+moves when told to, so a simulation runs as fast as the CPU allows and
+gives the same result every run. Time is shared by everything using it.
+*/
+class VirtualClock
+{
+  public:
+    static unsigned long now();
+    static void set(unsigned long ms);
+    static void advance(unsigned long ms);
+
+  private:
+    static unsigned long ms;
+};
+#endif
@@ -0,0 +1,143 @@
+/*
+  Arduino.cpp - Host (Linux) stand-in for the Arduino core used by the
+  mitsuAc host build.
+*/
+#include "Arduino.h"
+#include <stdio.h>
+#include <chrono>
+#include <thread>
+
+static std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+unsigned long millis(){
+    return static_cast<unsigned long>(std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - startTime).count());
+}
+
+unsigned long micros(){
+    return static_cast<unsigned long>(std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - startTime).count());
+}
+
+void delay(unsigned long ms){
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void yield(){
+    std::this_thread::yield();
+}
+
+extern "C" char* itoa(int val, char* s, int radix){
+    static const char digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+    char tmp[34];
+    int i = 0;
+    bool neg = (val < 0 && radix == 10);
+    unsigned int v = neg ? static_cast<unsigned int>(-(long)val) : static_cast<unsigned int>(val);
+    do {
+        tmp[i++] = digits[v % radix];
+        v /= radix;
+    } while (v);
+    int j = 0;
+    if (neg){
+        s[j++] = '-';
+    }
+    while (i){
+        s[j++] = tmp[--i];
+    }
+    s[j] = '\0';
+    return s;
+}
+
+extern "C" char* dtostrf(double val, signed char width, unsigned char prec, char* s){
+    sprintf(s, "%*.*f", width, prec, val);
+    return s;
+}
+
+/* HardwareSerial */
+
+HardwareSerial Serial;
+
+HardwareSerial::HardwareSerial() : _baud(0), _config(SERIAL_8N1), _open(false) {
+}
+
+void HardwareSerial::begin(unsigned long baud, SerialConfig config){
+    _baud = baud;
+    _config = config;
+    _open = true;
+}
+
+void HardwareSerial::end(){
+    _open = false;
+    _rx.clear();
+    _tx.clear();
+}
+
+int HardwareSerial::available(){
+    return static_cast<int>(_rx.size());
+}
+
+int HardwareSerial::availableForWrite(){
+    // Matches the ESP8266 UART TX FIFO, the peer drains it instantly
+    return 128;
+}
+
+int HardwareSerial::read(){
+    if (_rx.empty()){
+        return -1;
+    }
+    uint8_t b = _rx.front();
+    _rx.pop_front();
+    return b;
+}
+
+int HardwareSerial::peek(){
+    return _rx.empty() ? -1 : _rx.front();
+}
+
+size_t HardwareSerial::readBytes(uint8_t* buffer, size_t length){
+    size_t n = 0;
+    while (n < length && !_rx.empty()){
+        buffer[n++] = _rx.front();
+        _rx.pop_front();
+    }
+    return n;
+}
+
+size_t HardwareSerial::readBytes(char* buffer, size_t length){
+    return readBytes(reinterpret_cast<uint8_t*>(buffer), length);
+}
+
+size_t HardwareSerial::write(uint8_t b){
+    _tx.push_back(b);
+    return 1;
+}
+
+size_t HardwareSerial::write(const uint8_t* buffer, size_t length){
+    _tx.insert(_tx.end(), buffer, buffer + length);
+    return length;
+}
+
+void HardwareSerial::flush(){
+}
+
+HardwareSerial::operator bool() const {
+    return _open;
+}
+
+size_t HardwareSerial::peerWrite(const uint8_t* buffer, size_t length){
+    _rx.insert(_rx.end(), buffer, buffer + length);
+    return length;
+}
+
+size_t HardwareSerial::peerRead(uint8_t* buffer, size_t length){
+    size_t n = 0;
+    while (n < length && !_tx.empty()){
+        buffer[n++] = _tx.front();
+        _tx.pop_front();
+    }
+    return n;
+}
+
+size_t HardwareSerial::peerAvailable(){
+    return _tx.size();
+}
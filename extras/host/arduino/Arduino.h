@@ -0,0 +1,23 @@
+/*
+  Arduino.h - Host (Linux) stand-in for the Arduino core used by the
+  mitsuAc host build. Only what the library needs is provided.
+*/
+#ifndef __Host_Arduino_H__
+#define __Host_Arduino_H__
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "stdlib_noniso.h"
+
+typedef uint8_t byte;
+
+// Milliseconds/microseconds since the first call, from a monotonic clock
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void yield();
+
+#include "HardwareSerial.h"
+#endif
@@ -0,0 +1,55 @@
+/*
+  HardwareSerial.h - Host (Linux) stand-in for the Arduino HardwareSerial.
+
+  Bytes written by the library are queued for the peer (e.g. the heat pump
+  emulator) and bytes written by the peer are queued for the library to
+  read, so the pair behaves like a UART with nothing on the wire.
+*/
+#ifndef __Host_HardwareSerial_H__
+#define __Host_HardwareSerial_H__
+#include <stdint.h>
+#include <stddef.h>
+#include <deque>
+
+enum SerialConfig {
+    SERIAL_8N1 = 0x1c,
+    SERIAL_8E1 = 0x1e
+};
+
+class HardwareSerial
+{
+  public:
+    HardwareSerial();
+
+    // Library side, as on the MCU
+    void begin(unsigned long baud, SerialConfig config = SERIAL_8N1);
+    void end();
+    int available();
+    int availableForWrite();
+    int read();
+    int peek();
+    size_t readBytes(uint8_t* buffer, size_t length);
+    size_t readBytes(char* buffer, size_t length);
+    size_t write(uint8_t b);
+    size_t write(const uint8_t* buffer, size_t length);
+    void flush();
+    operator bool() const;
+
+    // Peer side, the other end of the wire
+    size_t peerWrite(const uint8_t* buffer, size_t length);
+    size_t peerRead(uint8_t* buffer, size_t length);
+    size_t peerAvailable();
+
+    unsigned long baud() const { return _baud; }
+    SerialConfig config() const { return _config; }
+
+  private:
+    unsigned long _baud;
+    SerialConfig _config;
+    bool _open;
+    std::deque<uint8_t> _rx; // peer -> library
+    std::deque<uint8_t> _tx; // library -> peer
+};
+
+extern HardwareSerial Serial;
+#endif
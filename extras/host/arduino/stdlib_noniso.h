@@ -0,0 +1,17 @@
+/*
+  stdlib_noniso.h - Host (Linux) stand-in for the ESP8266 non-ISO helpers.
+*/
+#ifndef __Host_stdlib_noniso_H__
+#define __Host_stdlib_noniso_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+char* itoa(int val, char* s, int radix);
+char* dtostrf(double val, signed char width, unsigned char prec, char* s);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,121 @@
+/*
+  mitsu_async.cpp - Drives a MitsuAc controller from coroutines
+
+  Usage: mitsu_async [--commands N] [--latency MS] [--nok RATE] [--virtual]
+
+  One coroutine applies a list of settings in turn, reading the room
+  temperature back after each, while another refreshes the room
+  temperature every few seconds. Each operation is printed with how long
+  it took to complete.
+  --virtual runs on a VirtualClock, as fast as it will go.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "Arduino.h"
+#include "MitsuAc.h"
+#include "MitsuAsync.h"
+#include "HeatPumpEmulator.h"
+#include "VirtualClock.h"
+
+static const char* commands[] = {
+    "{\"pwr\":\"on\",\"mode\":\"heat\",\"fan\":\"2\",\"vane\":\"3\",\"wdvane\":\"center\",\"stemp\":23}",
+    "{\"pwr\":\"on\",\"mode\":\"cool\",\"fan\":\"auto\",\"vane\":\"swing\",\"wdvane\":\"swing\",\"stemp\":19}",
+    "{\"stemp\":20}",
+    "{\"pwr\":\"off\",\"mode\":\"auto\",\"fan\":\"quiet\",\"vane\":\"auto\",\"wdvane\":\"half_left\",\"stemp\":21}"
+};
+
+struct options_t {
+    int commands;
+    unsigned long latency;
+    double nok;
+};
+
+static void pass(MitsuClock*){
+    delay(1);
+}
+
+static void pass(VirtualClock*){
+    VirtualClock::advance(1);
+}
+
+template <typename Async, typename Clock>
+static MitsuTask<> applyAll(Async& async, int count, bool* done){
+    MitsuProtocol ml;
+    unsigned long total = 0;
+    for (int i = 0; i < count; i++){
+        MitsuProtocol::settings_t settings;
+        ml.settingsFromJson(commands[i % 4], &settings);
+
+        unsigned long start = Clock::now();
+        bool ok = co_await async.apply(settings);
+        unsigned long applied = Clock::now() - start;
+        total += applied;
+        printf("%8lu ms apply %s %s in %lu ms\n", Clock::now(), commands[i % 4], ok ? "confirmed" : "timed out", applied);
+
+        start = Clock::now();
+        ok = co_await async.refresh(MitsuProtocol::roomTemp);
+        printf("%8lu ms refresh room temp %s in %lu ms\n", Clock::now(), ok ? "read" : "timed out", Clock::now() - start);
+    }
+    if (count > 0){
+        printf("mean apply to confirm %lu ms\n", total / count);
+    }
+    *done = true;
+}
+
+template <typename Async, typename Clock>
+static MitsuTask<> watchRoomTemp(Async& async, const bool* done){
+    while (!*done){
+        co_await async.delay(3000);
+        unsigned long start = Clock::now();
+        bool ok = co_await async.refresh(MitsuProtocol::roomTemp);
+        printf("%8lu ms watcher room temp %s in %lu ms\n", Clock::now(), ok ? "read" : "timed out", Clock::now() - start);
+    }
+}
+
+template <typename Clock>
+static int run(const options_t& opt){
+    HardwareSerial serial;
+    HeatPumpEmulator unit;
+    unit.setLatency(opt.latency);
+    unit.setNokRate(opt.nok);
+    unit.setClock(Clock::now);
+
+    typedef MitsuAcT<HardwareSerial, MitsuTiming, Clock> ac_t;
+    ac_t ac(&serial);
+    MitsuExecutor executor;
+    MitsuAsync<ac_t> async(&ac, &executor);
+
+    ac.initialize();
+    bool done = false;
+    executor.spawn(applyAll<MitsuAsync<ac_t>, Clock>(async, opt.commands, &done));
+    executor.spawn(watchRoomTemp<MitsuAsync<ac_t>, Clock>(async, &done));
+
+    while (executor.getRunning() > 0){
+        unit.service(&serial);
+        ac.monitor();
+        async.checkTimeouts();
+        executor.run();
+        pass(static_cast<Clock*>(NULL));
+    }
+    return 0;
+}
+
+int main(int argc, char** argv){
+    options_t opt = {8, 30, 0.0};
+    bool virtualClock = false;
+
+    for (int i = 1; i < argc; i++){
+        bool hasValue = (i + 1 < argc);
+        if (strcmp(argv[i], "--virtual") == 0){ virtualClock = true; }
+        else if (hasValue && strcmp(argv[i], "--commands") == 0){ opt.commands = atoi(argv[++i]); }
+        else if (hasValue && strcmp(argv[i], "--latency") == 0){ opt.latency = strtoul(argv[++i], NULL, 10); }
+        else if (hasValue && strcmp(argv[i], "--nok") == 0){ opt.nok = atof(argv[++i]); }
+        else {
+            fprintf(stderr, "usage: %s [--commands N] [--latency MS] [--nok RATE] [--virtual]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    return virtualClock ? run<VirtualClock>(opt) : run<MitsuClock>(opt);
+}
@@ -0,0 +1,502 @@
+/*
+  mitsu_bench.cpp - Micro-benchmarks of the protocol encoders, decoder and
+  json handling
+
+  Usage: mitsu_bench [--capture FILE] [--ms N] [--noise RATE] [--ber RATE]
+                     [--seed N] [--filter TEXT]
+
+  Each benchmark is timed over about --ms ms (200 by default) and its
+  stack use measured by running one operation on a painted ucontext
+  stack, less what an empty operation uses. The decoder runs over a
+  corpus of frames captured from a unit, or the rx side of --capture, and
+  over a noisy stream of the same frames with random bytes inserted
+  between them (--noise, per byte) and bits flipped (--ber). The json
+  parser's results are checked first, exiting with status 1 if one is
+  wrong.
+
+  Numbers are for the host CPU. They don't say how fast an ESP8266 is,
+  but a change that makes them worse makes that slower too.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+#include <chrono>
+#include <vector>
+#include "Arduino.h"
+#include "MitsuAc.h"
+#include "CaptureFile.h"
+
+typedef std::chrono::steady_clock steadyClock;
+typedef void (*benchFn_t)(unsigned long n);
+
+// Frames from a unit, less the checksum which is added on loading
+static const uint8_t corpusFrames[][21] = {
+    {0xfc, 0x5a, 0x01, 0x30, 0x02, 0xca, 0x01},                                  // connect
+    {0xfc, 0x7a, 0x01, 0x30, 0x01, 0x00},                                        // connect ok
+    {0xfc, 0x42, 0x01, 0x30, 0x10, 0x02},                                        // settings request
+    {0xfc, 0x62, 0x01, 0x30, 0x10, 0x02, 0x00, 0x00, 0x01, 0x01, 0x09, 0x00,
+     0x00, 0x00, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00},                      // settings, heat 22
+    {0xfc, 0x42, 0x01, 0x30, 0x10, 0x03},                                        // room temp request
+    {0xfc, 0x62, 0x01, 0x30, 0x10, 0x03, 0x00, 0x00, 0x0b, 0x00, 0x00, 0xaa,
+     0xab, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},                      // room temp 21
+    {0xfc, 0x41, 0x01, 0x30, 0x10, 0x01, 0x9f, 0x00, 0x01, 0x03, 0x0c, 0x00,
+     0x07, 0x00, 0x00, 0x05},                                                    // settings, cool 19 swing
+    {0xfc, 0x61, 0x01, 0x30, 0x10}                                               // ok
+};
+
+static const char* commandJson =
+    "{\"pwr\":\"on\",\"mode\":\"cool\",\"fan\":\"auto\",\"vane\":\"swing\",\"wdvane\":\"swing\",\"stemp\":19}";
+
+struct options_t {
+    const char* capturePath;
+    unsigned long ms;
+    double noise;
+    double ber;
+    uint32_t seed;
+    const char* filter;
+};
+
+// Shared by the benchmarks
+static MitsuProtocol ml;
+static MitsuProtocol::packetBuilder pb(&ml);
+static HardwareSerial serial;
+static MitsuAc ac(&serial);
+static std::vector<uint8_t> corpus;
+static std::vector<uint8_t> noisy;
+static size_t corpusFrameCount;
+static MitsuProtocol::settings_t settings;
+static MitsuProtocol::settings_t current;
+static volatile uint32_t sink;
+
+static uint32_t seed;
+
+// Commands checked before anything is timed, so a faster parser can't
+// be a wrong one: whether each parses, and the fields it sets
+struct jsonCase_t {
+    const char* json;
+    bool ok;
+    uint8_t valid;
+};
+
+static const jsonCase_t jsonCases[] = {
+    {"{\"pwr\":\"on\",\"stemp\":22}", true, MitsuProtocol::control_t::power | MitsuProtocol::control_t::temp},
+    {"{}", true, 0},
+    {"{\"meta\":{\"src\":\"ha\"},\"pwr\":\"on\"}", true, MitsuProtocol::control_t::power},
+    {"{\"tags\":[1,{\"a\":\"]}\"},[]],\"mode\":\"cool\"}", true, MitsuProtocol::control_t::mode},
+    {"{\"seen\":null,\"n\":-1.5e3,\"fan\":\"auto\"}", true, MitsuProtocol::control_t::fan},
+    {"{\"pwr\":{\"on\":true}}", false, 0},
+    {"{\"meta\":{\"src\":\"ha\"", false, 0},
+    {"{\"deep\":[[[[[[[[[1]]]]]]]]]}", false, 0},
+    {"{\"pwr\":\"sideways\"}", false, 0},
+    {"{\"stemp\":40}", false, 0}
+};
+
+static bool checkJson(){
+    bool passed = true;
+    for (size_t i = 0; i < sizeof(jsonCases) / sizeof(jsonCases[0]); i++){
+        const jsonCase_t& c = jsonCases[i];
+        MitsuProtocol::settings_t parsed;
+        bool ok = ml.settingsFromJson(c.json, &parsed);
+        if (ok != c.ok || (ok && parsed.valid != c.valid)){
+            fprintf(stderr, "settingsFromJson %s: %s, valid %02x\n", c.json, ok ? "parsed" : "failed", parsed.valid);
+            passed = false;
+        }
+    }
+    return passed;
+}
+
+// xorshift32, so runs with the same seed get the same noise
+static uint32_t nextRandom(){
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+static double nextUniform(){
+    return nextRandom() / 4294967296.0;
+}
+
+static void addFrame(std::vector<uint8_t>* stream, const uint8_t* frame, int lenWithoutChecksum){
+    stream->insert(stream->end(), frame, frame + lenWithoutChecksum);
+    stream->push_back(MitsuProtocol::calculateChecksum(frame, lenWithoutChecksum));
+}
+
+// Frames in the corpus as the decoder sees them
+static size_t countFrames(){
+    MitsuProtocol::packetBuilder counter(&ml);
+    size_t frames = 0;
+    for (size_t i = 0; i < corpus.size(); i++){
+        counter.addByte(corpus[i]);
+        if (counter.complete() && counter.valid()){
+            frames++;
+        }
+    }
+    return frames;
+}
+
+static void loadCorpus(){
+    for (size_t i = 0; i < sizeof(corpusFrames) / sizeof(corpusFrames[0]); i++){
+        const uint8_t* frame = corpusFrames[i];
+        addFrame(&corpus, frame, 5 + frame[4]);
+    }
+    corpusFrameCount = countFrames();
+}
+
+static bool loadCapture(const char* path){
+    CaptureReader reader;
+    if (!reader.open(path)){
+        return false;
+    }
+    MitsuCapture::record_t rec;
+    corpus.clear();
+    while (reader.next(&rec)){
+        if (rec.dir == MitsuCapture::rx){
+            corpus.insert(corpus.end(), rec.data, rec.data + rec.len);
+        }
+    }
+    corpusFrameCount = countFrames();
+    return !corpus.empty();
+}
+
+// The corpus a few times over, with garbage between bytes and bits flipped
+static void makeNoisy(double noise, double ber){
+    for (int copy = 0; copy < 16; copy++){
+        for (size_t i = 0; i < corpus.size(); i++){
+            while (nextUniform() < noise){
+                noisy.push_back(static_cast<uint8_t>(nextRandom()));
+            }
+            uint8_t b = corpus[i];
+            for (int bit = 0; bit < 8; bit++){
+                if (nextUniform() < ber){
+                    b ^= (1 << bit);
+                }
+            }
+            noisy.push_back(b);
+        }
+    }
+}
+
+/* Benchmarks, each does n operations */
+
+static void benchChecksum(unsigned long n){
+    uint8_t frame[22];
+    memcpy(frame, corpusFrames[3], 21);
+    for (unsigned long i = 0; i < n; i++){
+        frame[10] = static_cast<uint8_t>(i);
+        sink += MitsuProtocol::calculateChecksum(frame, 21);
+    }
+}
+
+static void benchTxSettings(unsigned long n){
+    uint8_t buf[32];
+    for (unsigned long i = 0; i < n; i++){
+        settings.tempDegC = 16 + (i & 0x0f);
+        sink += ml.getTxSettingsPacket(buf, settings) + buf[21];
+    }
+}
+
+static void benchTxSettingsDiff(unsigned long n){
+    uint8_t buf[32];
+    for (unsigned long i = 0; i < n; i++){
+        settings.tempDegC = 16 + (i & 0x0f);
+        sink += ml.getTxSettingsPacket(buf, settings, current) + buf[21];
+    }
+}
+
+static void benchTxInfo(unsigned long n){
+    uint8_t buf[32];
+    for (unsigned long i = 0; i < n; i++){
+        sink += ml.getTxInfoPacket(buf, (i & 1) ? MitsuProtocol::roomTemp : MitsuProtocol::settings) + buf[21];
+    }
+}
+
+static void benchTxConnect(unsigned long n){
+    uint8_t buf[32];
+    for (unsigned long i = 0; i < n; i++){
+        sink += ml.getTxConnectPacket(buf) + buf[7];
+    }
+}
+
+// One byte through addByte(), complete(), valid() and, at the end of a
+// frame, getData()
+static void decodeBytes(const std::vector<uint8_t>& stream, unsigned long n){
+    size_t pos = 0;
+    for (unsigned long i = 0; i < n; i++){
+        pb.addByte(stream[pos]);
+        if (pb.complete() && pb.valid()){
+            MitsuProtocol::msg_t msg = pb.getData();
+            sink += msg.kind;
+        }
+        if (++pos == stream.size()){
+            pos = 0;
+        }
+    }
+}
+
+// n bytes through addBytes() in the controller's 32 byte chunks
+static void decodeChunks(const std::vector<uint8_t>& stream, unsigned long n){
+    MitsuProtocol::msg_t msgs[32 / MitsuProtocol::packetBuilder::MIN_PACKET_LEN + 1];
+    size_t pos = 0;
+    while (n > 0){
+        size_t len = stream.size() - pos;
+        len = len < 32 ? len : 32;
+        len = len < n ? len : n;
+        size_t offset = 0;
+        while (offset < len){
+            size_t consumed = 0;
+            size_t found = pb.addBytes(&stream[pos + offset], len - offset, msgs,
+                                       sizeof(msgs) / sizeof(msgs[0]), &consumed);
+            sink += found ? msgs[0].kind : 0;
+            offset += consumed;
+        }
+        n -= len;
+        pos = (pos + len == stream.size()) ? 0 : pos + len;
+    }
+}
+
+static void benchDecodeCorpus(unsigned long n){ decodeBytes(corpus, n); }
+static void benchDecodeNoisy(unsigned long n){ decodeBytes(noisy, n); }
+static void benchChunksCorpus(unsigned long n){ decodeChunks(corpus, n); }
+static void benchChunksNoisy(unsigned long n){ decodeChunks(noisy, n); }
+
+static void benchPowerToString(unsigned long n){
+    const MitsuProtocol::enumTable_t& t = MitsuProtocol::powerTable;
+    for (unsigned long i = 0; i < n; i++){
+        sink += MitsuProtocol::power_tToString(static_cast<MitsuProtocol::power_t>(t.names[i % t.count].value))[0];
+    }
+}
+
+static void benchModeToString(unsigned long n){
+    const MitsuProtocol::enumTable_t& t = MitsuProtocol::modeTable;
+    for (unsigned long i = 0; i < n; i++){
+        sink += MitsuProtocol::mode_tToString(static_cast<MitsuProtocol::mode_t>(t.names[i % t.count].value))[0];
+    }
+}
+
+static void benchFanToString(unsigned long n){
+    const MitsuProtocol::enumTable_t& t = MitsuProtocol::fanTable;
+    for (unsigned long i = 0; i < n; i++){
+        sink += MitsuProtocol::fan_tToString(static_cast<MitsuProtocol::fan_t>(t.names[i % t.count].value))[0];
+    }
+}
+
+static void benchVaneToString(unsigned long n){
+    const MitsuProtocol::enumTable_t& t = MitsuProtocol::vaneTable;
+    for (unsigned long i = 0; i < n; i++){
+        sink += MitsuProtocol::vane_tToString(static_cast<MitsuProtocol::vane_t>(t.names[i % t.count].value))[0];
+    }
+}
+
+static void benchWideVaneToString(unsigned long n){
+    const MitsuProtocol::enumTable_t& t = MitsuProtocol::wideVaneTable;
+    for (unsigned long i = 0; i < n; i++){
+        sink += MitsuProtocol::wideVane_tToString(static_cast<MitsuProtocol::wideVane_t>(t.names[i % t.count].value))[0];
+    }
+}
+
+static void benchPowerFromString(unsigned long n){
+    const MitsuProtocol::enumTable_t& t = MitsuProtocol::powerTable;
+    MitsuProtocol::power_t v;
+    bool ok;
+    for (unsigned long i = 0; i < n; i++){
+        ml.power_tFromString(t.names[i % t.count].name, &v, ok);
+        sink += static_cast<uint8_t>(v) + ok;
+    }
+}
+
+static void benchModeFromString(unsigned long n){
+    const MitsuProtocol::enumTable_t& t = MitsuProtocol::modeTable;
+    MitsuProtocol::mode_t v;
+    bool ok;
+    for (unsigned long i = 0; i < n; i++){
+        ml.mode_tFromString(t.names[i % t.count].name, &v, ok);
+        sink += static_cast<uint8_t>(v) + ok;
+    }
+}
+
+static void benchFanFromString(unsigned long n){
+    const MitsuProtocol::enumTable_t& t = MitsuProtocol::fanTable;
+    MitsuProtocol::fan_t v;
+    bool ok;
+    for (unsigned long i = 0; i < n; i++){
+        ml.fan_tFromString(t.names[i % t.count].name, &v, ok);
+        sink += static_cast<uint8_t>(v) + ok;
+    }
+}
+
+static void benchVaneFromString(unsigned long n){
+    const MitsuProtocol::enumTable_t& t = MitsuProtocol::vaneTable;
+    MitsuProtocol::vane_t v;
+    bool ok;
+    for (unsigned long i = 0; i < n; i++){
+        ml.vane_tFromString(t.names[i % t.count].name, &v, ok);
+        sink += static_cast<uint8_t>(v) + ok;
+    }
+}
+
+static void benchWideVaneFromString(unsigned long n){
+    const MitsuProtocol::enumTable_t& t = MitsuProtocol::wideVaneTable;
+    MitsuProtocol::wideVane_t v;
+    bool ok;
+    for (unsigned long i = 0; i < n; i++){
+        ml.wideVane_tFromString(t.names[i % t.count].name, &v, ok);
+        sink += static_cast<uint8_t>(v) + ok;
+    }
+}
+
+static void benchSettingsFromJson(unsigned long n){
+    MitsuProtocol::settings_t parsed;
+    for (unsigned long i = 0; i < n; i++){
+        sink += ml.settingsFromJson(commandJson, &parsed) + parsed.tempDegC;
+    }
+}
+
+static void benchPutSettingsJson(unsigned long n){
+    for (unsigned long i = 0; i < n; i++){
+        sink += ac.putSettingsJson(commandJson);
+    }
+}
+
+static void benchGetSettingsJson(unsigned long n){
+    char json[256];
+    for (unsigned long i = 0; i < n; i++){
+        sink += ac.getSettingsJson(json, sizeof(json));
+    }
+}
+
+static void benchNothing(unsigned long){
+}
+
+struct bench_t {
+    const char* name;
+    const char* op;
+    benchFn_t fn;
+};
+
+static const bench_t benches[] = {
+    {"calculateChecksum",            "frame",   benchChecksum},
+    {"getTxSettingsPacket",          "frame",   benchTxSettings},
+    {"getTxSettingsPacket current",  "frame",   benchTxSettingsDiff},
+    {"getTxInfoPacket",              "frame",   benchTxInfo},
+    {"getTxConnectPacket",           "frame",   benchTxConnect},
+    {"addByte corpus",               "byte",    benchDecodeCorpus},
+    {"addByte noisy",                "byte",    benchDecodeNoisy},
+    {"addBytes corpus",              "byte",    benchChunksCorpus},
+    {"addBytes noisy",               "byte",    benchChunksNoisy},
+    {"power_tToString",              "call",    benchPowerToString},
+    {"mode_tToString",               "call",    benchModeToString},
+    {"fan_tToString",                "call",    benchFanToString},
+    {"vane_tToString",               "call",    benchVaneToString},
+    {"wideVane_tToString",           "call",    benchWideVaneToString},
+    {"power_tFromString",            "call",    benchPowerFromString},
+    {"mode_tFromString",             "call",    benchModeFromString},
+    {"fan_tFromString",              "call",    benchFanFromString},
+    {"vane_tFromString",             "call",    benchVaneFromString},
+    {"wideVane_tFromString",         "call",    benchWideVaneFromString},
+    {"settingsFromJson",             "call",    benchSettingsFromJson},
+    {"putSettingsJson",              "call",    benchPutSettingsJson},
+    {"getSettingsJson",              "call",    benchGetSettingsJson}
+};
+
+/* Stack use, by painting a stack and seeing how much of it got written */
+
+static const size_t STACK_SIZE = 64 * 1024;
+static const uint8_t STACK_PAINT = 0xa5;
+static ucontext_t mainContext;
+static ucontext_t benchContext;
+static benchFn_t stackFn;
+
+static void stackEntry(){
+    stackFn(1);
+}
+
+static long stackUsed(benchFn_t fn){
+    static std::vector<uint8_t> stack(STACK_SIZE);
+    memset(&stack[0], STACK_PAINT, STACK_SIZE);
+    stackFn = fn;
+    getcontext(&benchContext);
+    benchContext.uc_stack.ss_sp = &stack[0];
+    benchContext.uc_stack.ss_size = STACK_SIZE;
+    benchContext.uc_link = &mainContext;
+    makecontext(&benchContext, stackEntry, 0);
+    if (swapcontext(&mainContext, &benchContext) != 0){
+        return -1;
+    }
+    // The stack grows down, the lowest byte touched marks the deepest point
+    size_t untouched = 0;
+    while (untouched < STACK_SIZE && stack[untouched] == STACK_PAINT){
+        untouched++;
+    }
+    return static_cast<long>(STACK_SIZE - untouched);
+}
+
+// ns per op, running ever more ops until they take ms
+static double timeBench(benchFn_t fn, unsigned long ms, unsigned long* ops){
+    unsigned long n = 1;
+    fn(1000); // Warm up
+    for (;;){
+        steadyClock::time_point start = steadyClock::now();
+        fn(n);
+        double elapsed = std::chrono::duration<double, std::milli>(steadyClock::now() - start).count();
+        if (elapsed >= ms || n >= (1UL << 40)){
+            *ops = n;
+            return elapsed * 1e6 / n;
+        }
+        unsigned long grow = (elapsed > 0) ? static_cast<unsigned long>(n * (ms * 1.2 / elapsed)) : n * 100;
+        n = grow > n * 100 ? n * 100 : (grow > n ? grow : n * 2);
+    }
+}
+
+int main(int argc, char** argv){
+    options_t opt = {NULL, 200, 0.05, 0.001, 1, NULL};
+
+    for (int i = 1; i < argc; i++){
+        bool hasValue = (i + 1 < argc);
+        if (hasValue && strcmp(argv[i], "--capture") == 0){ opt.capturePath = argv[++i]; }
+        else if (hasValue && strcmp(argv[i], "--ms") == 0){ opt.ms = strtoul(argv[++i], NULL, 10); }
+        else if (hasValue && strcmp(argv[i], "--noise") == 0){ opt.noise = atof(argv[++i]); }
+        else if (hasValue && strcmp(argv[i], "--ber") == 0){ opt.ber = atof(argv[++i]); }
+        else if (hasValue && strcmp(argv[i], "--seed") == 0){ opt.seed = strtoul(argv[++i], NULL, 10); }
+        else if (hasValue && strcmp(argv[i], "--filter") == 0){ opt.filter = argv[++i]; }
+        else {
+            fprintf(stderr, "usage: %s [--capture FILE] [--ms N] [--noise RATE] [--ber RATE] [--seed N] [--filter TEXT]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (!checkJson()){
+        return 1;
+    }
+    seed = opt.seed ? opt.seed : 1;
+    loadCorpus();
+    if (opt.capturePath && !loadCapture(opt.capturePath)){
+        fprintf(stderr, "%s: not a capture file, or no rx bytes in it\n", opt.capturePath);
+        return 1;
+    }
+    makeNoisy(opt.noise, opt.ber);
+
+    ml.settingsFromJson(commandJson, &settings);
+    current = settings;
+    current.mode = MitsuProtocol::mode_t::modeHeat;
+    current.valid = MitsuProtocol::ALL_SETTINGS;
+
+    printf("corpus: %zu bytes, %zu frames%s; noisy: %zu bytes\n", corpus.size(), corpusFrameCount,
+           opt.capturePath ? " from the capture" : "", noisy.size());
+    printf("%-30s %10s %8s %12s\n", "benchmark", "ns/op", "stack B", "ops");
+
+    long baseline = stackUsed(benchNothing);
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++){
+        const bench_t& b = benches[i];
+        if (opt.filter && !strstr(b.name, opt.filter)){
+            continue;
+        }
+        b.fn(1); // Lazy symbol binding and the like happen outside the measurement
+        long stack = stackUsed(b.fn) - baseline;
+        unsigned long ops;
+        double ns = timeBench(b.fn, opt.ms, &ops);
+        printf("%-30s %10.2f %8ld %12lu %s\n", b.name, ns, stack, ops, b.op);
+    }
+    return 0;
+}
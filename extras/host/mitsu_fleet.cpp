@@ -0,0 +1,284 @@
+/*
+  mitsu_fleet.cpp - Benchmarks many MitsuAc controllers on a virtual clock
+
+  Usage: mitsu_fleet [--units N] [--minutes N] [--interval S] [--latency MS]
+                     [--ber RATE] [--nok RATE] [--seed N]
+                     [--max-cpu US] [--max-p99 MS] [--min-fps N]
+
+  Runs --units controllers (1000 by default, up to 10000), each against
+  its own HeatPumpEmulator over an in-memory serial, for --minutes of
+  simulated time. Every unit is given a random command every --interval
+  seconds and publishes its settings json whenever they change. Units are
+  only run when due, their controller's getNextDeadline(), a reply from
+  their emulator or their next command, and the clock jumps from one to
+  the next.
+
+  Reports the controller CPU time (monitor(), putSettingsJson() and
+  getSettingsJson()) per unit per simulated minute, frames decoded per
+  second of that CPU time, memory per unit and the command to confirmed
+  latency percentiles. Any --max-/--min- threshold missed is printed and
+  the exit status is 2, so it can gate changes to the library.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <vector>
+#include "Arduino.h"
+#include "MitsuAc.h"
+#include "HeatPumpEmulator.h"
+#include "VirtualClock.h"
+
+typedef MitsuAcT<HardwareSerial, MitsuTiming, VirtualClock> ac_t;
+typedef std::chrono::steady_clock steadyClock;
+
+static const int MAX_UNITS = 10000;
+
+static const char* commands[] = {
+    "{\"pwr\":\"on\",\"mode\":\"heat\",\"fan\":\"2\",\"vane\":\"3\",\"wdvane\":\"center\",\"stemp\":23}",
+    "{\"pwr\":\"on\",\"mode\":\"cool\",\"fan\":\"auto\",\"vane\":\"swing\",\"wdvane\":\"swing\",\"stemp\":19}",
+    "{\"stemp\":20}",
+    "{\"fan\":\"quiet\",\"vane\":\"auto\"}",
+    "{\"pwr\":\"off\",\"mode\":\"auto\",\"fan\":\"quiet\",\"vane\":\"auto\",\"wdvane\":\"half_left\",\"stemp\":21}"
+};
+static const int COMMAND_COUNT = sizeof(commands) / sizeof(commands[0]);
+
+struct options_t {
+    int units;
+    unsigned long minutes;
+    unsigned long interval;
+    unsigned long latency;
+    double ber;
+    double nok;
+    uint32_t seed;
+    double maxCpu;
+    double maxP99;
+    double minFps;
+};
+
+struct unit_t {
+    HardwareSerial serial;
+    HeatPumpEmulator emulator;
+    ac_t ac;
+    unsigned long wakeAt;
+    unsigned long nextCommandAt;
+    unsigned long commandAt;
+    bool awaitingConfirm;
+
+    unit_t() : ac(&serial), wakeAt(0), nextCommandAt(0), commandAt(0), awaitingConfirm(false) {
+    }
+};
+
+static uint32_t seed;
+
+// xorshift32, so runs with the same seed give the same schedule
+static uint32_t nextRandom(){
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+static long residentBytes(){
+    long pages = 0, resident = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (f){
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2){
+            resident = 0;
+        }
+        fclose(f);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static double processCpuSeconds(){
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long percentile(std::vector<unsigned long>& sorted, double p){
+    if (sorted.empty()){
+        return 0;
+    }
+    size_t i = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+    return sorted[i];
+}
+
+// When the unit next has something to do, never before the next ms
+static unsigned long nextWake(unit_t& u, unsigned long now){
+    unsigned long next = u.ac.getNextDeadline();
+    unsigned long reply;
+    if (u.emulator.getNextReplyTime(&reply) && (long)(reply - next) < 0){
+        next = reply;
+    }
+    if ((long)(u.nextCommandAt - next) < 0){
+        next = u.nextCommandAt;
+    }
+    return ((long)(next - now) > 0) ? next : now + 1;
+}
+
+static int run(const options_t& opt){
+    seed = opt.seed ? opt.seed : 1;
+    VirtualClock::set(0);
+
+    long rssBefore = residentBytes();
+    std::vector<std::unique_ptr<unit_t> > units;
+    units.reserve(opt.units);
+    for (int i = 0; i < opt.units; i++){
+        units.push_back(std::unique_ptr<unit_t>(new unit_t()));
+    }
+
+    unsigned long published = 0;
+    steadyClock::duration controllerTime(0);
+    for (int i = 0; i < opt.units; i++){
+        unit_t& u = *units[i];
+        u.emulator.setLatency(opt.latency);
+        u.emulator.setBitErrorRate(opt.ber);
+        u.emulator.setNokRate(opt.nok);
+        u.emulator.setSeed(nextRandom());
+        u.emulator.setClock(VirtualClock::now);
+        u.ac.setChangeCb([&u, &published](uint16_t){
+            char json[256];
+            u.ac.getSettingsJson(json, sizeof(json));
+            published++;
+        });
+        u.ac.initialize();
+        u.nextCommandAt = MitsuTiming::SETTLE_TIME + nextRandom() % (opt.interval * 1000);
+    }
+    long rssAfter = residentBytes();
+
+    typedef std::pair<unsigned long, int> wake_t;
+    std::priority_queue<wake_t, std::vector<wake_t>, std::greater<wake_t> > due;
+    for (int i = 0; i < opt.units; i++){
+        units[i]->wakeAt = nextWake(*units[i], 0);
+        due.push(wake_t(units[i]->wakeAt, i));
+    }
+
+    std::vector<unsigned long> confirmTimes;
+    unsigned long commandsSent = 0;
+    unsigned long wakes = 0;
+    unsigned long end = opt.minutes * 60000;
+    double cpuStart = processCpuSeconds();
+    steadyClock::time_point wallStart = steadyClock::now();
+
+    while (!due.empty() && due.top().first < end){
+        wake_t w = due.top();
+        due.pop();
+        unit_t& u = *units[w.second];
+        if (w.first != u.wakeAt){
+            continue; // Superseded
+        }
+        VirtualClock::set(w.first);
+        unsigned long now = w.first;
+        wakes++;
+
+        u.emulator.service(&u.serial);
+        steadyClock::time_point t0 = steadyClock::now();
+        if ((long)(now - u.nextCommandAt) >= 0){
+            u.ac.putSettingsJson(commands[nextRandom() % COMMAND_COUNT]);
+            commandsSent++;
+            if (!u.awaitingConfirm){
+                u.awaitingConfirm = true;
+                u.commandAt = now;
+            }
+            u.nextCommandAt = now + opt.interval * 1000;
+        }
+        u.ac.monitor();
+        controllerTime += steadyClock::now() - t0;
+        u.emulator.service(&u.serial);
+
+        if (u.awaitingConfirm && u.ac.isTargetAchieved()){
+            u.awaitingConfirm = false;
+            confirmTimes.push_back(now - u.commandAt);
+        }
+
+        u.wakeAt = nextWake(u, now);
+        due.push(wake_t(u.wakeAt, w.second));
+    }
+
+    double wallSeconds = std::chrono::duration<double>(steadyClock::now() - wallStart).count();
+    double cpuSeconds = processCpuSeconds() - cpuStart;
+    double controllerSeconds = std::chrono::duration<double>(controllerTime).count();
+
+    unsigned long frames = 0, retries = 0, timeouts = 0, noks = 0, unconfirmed = 0;
+    for (int i = 0; i < opt.units; i++){
+        MitsuAcBase::stats_t s;
+        units[i]->ac.getStats(&s);
+        for (int k = 0; k < MitsuProtocol::MSG_KIND_COUNT; k++){
+            frames += s.rx.frames[k];
+        }
+        retries += s.requestRetries;
+        timeouts += s.requestTimeouts;
+        noks += s.settingsNoks;
+        unconfirmed += units[i]->awaitingConfirm ? 1 : 0;
+    }
+    std::sort(confirmTimes.begin(), confirmTimes.end());
+
+    double unitMinutes = static_cast<double>(opt.units) * opt.minutes;
+    double cpuPerUnitMinute = controllerSeconds * 1e6 / unitMinutes;
+    double fps = controllerSeconds > 0 ? frames / controllerSeconds : 0;
+    unsigned long p50 = percentile(confirmTimes, 0.50);
+    unsigned long p99 = percentile(confirmTimes, 0.99);
+
+    printf("units: %d for %lu simulated minutes, %lu wakes, ran in %.2f s (%.2f s cpu)\n",
+           opt.units, opt.minutes, wakes, wallSeconds, cpuSeconds);
+    printf("cpu: controller %.1f us per unit per simulated minute, %.1f us with the emulator and scheduling\n",
+           cpuPerUnitMinute, cpuSeconds * 1e6 / unitMinutes);
+    printf("decode: %lu frames, %.0f frames/s of controller cpu\n", frames, fps);
+    printf("memory: controller %zu bytes, %ld bytes resident per unit with its emulator\n",
+           sizeof(ac_t), (rssAfter - rssBefore) / opt.units);
+    printf("confirm: p50 %lu ms, p99 %lu ms, max %lu ms over %zu commands (%lu sent, %lu unconfirmed at the end)\n",
+           p50, p99, confirmTimes.empty() ? 0 : confirmTimes.back(), confirmTimes.size(), commandsSent, unconfirmed);
+    printf("link: %lu retries, %lu timeouts, %lu noks, %lu settings published\n", retries, timeouts, noks, published);
+
+    bool failed = false;
+    if (opt.maxCpu > 0 && cpuPerUnitMinute > opt.maxCpu){
+        printf("FAIL cpu %.1f us > %.1f us\n", cpuPerUnitMinute, opt.maxCpu);
+        failed = true;
+    }
+    if (opt.maxP99 > 0 && p99 > opt.maxP99){
+        printf("FAIL p99 %lu ms > %.0f ms\n", p99, opt.maxP99);
+        failed = true;
+    }
+    if (opt.minFps > 0 && fps < opt.minFps){
+        printf("FAIL decode %.0f frames/s < %.0f frames/s\n", fps, opt.minFps);
+        failed = true;
+    }
+    return failed ? 2 : 0;
+}
+
+int main(int argc, char** argv){
+    options_t opt = {1000, 10, 60, 30, 0.0, 0.0, 1, 0, 0, 0};
+
+    for (int i = 1; i < argc; i++){
+        bool hasValue = (i + 1 < argc);
+        if (hasValue && strcmp(argv[i], "--units") == 0){ opt.units = atoi(argv[++i]); }
+        else if (hasValue && strcmp(argv[i], "--minutes") == 0){ opt.minutes = strtoul(argv[++i], NULL, 10); }
+        else if (hasValue && strcmp(argv[i], "--interval") == 0){ opt.interval = strtoul(argv[++i], NULL, 10); }
+        else if (hasValue && strcmp(argv[i], "--latency") == 0){ opt.latency = strtoul(argv[++i], NULL, 10); }
+        else if (hasValue && strcmp(argv[i], "--ber") == 0){ opt.ber = atof(argv[++i]); }
+        else if (hasValue && strcmp(argv[i], "--nok") == 0){ opt.nok = atof(argv[++i]); }
+        else if (hasValue && strcmp(argv[i], "--seed") == 0){ opt.seed = strtoul(argv[++i], NULL, 10); }
+        else if (hasValue && strcmp(argv[i], "--max-cpu") == 0){ opt.maxCpu = atof(argv[++i]); }
+        else if (hasValue && strcmp(argv[i], "--max-p99") == 0){ opt.maxP99 = atof(argv[++i]); }
+        else if (hasValue && strcmp(argv[i], "--min-fps") == 0){ opt.minFps = atof(argv[++i]); }
+        else {
+            fprintf(stderr, "usage: %s [--units N] [--minutes N] [--interval S] [--latency MS] [--ber RATE] [--nok RATE]\n"
+                            "       [--seed N] [--max-cpu US] [--max-p99 MS] [--min-fps N]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (opt.units < 1 || opt.units > MAX_UNITS || opt.minutes < 1 || opt.interval < 1){
+        fprintf(stderr, "%s: --units 1 to %d, --minutes and --interval at least 1\n", argv[0], MAX_UNITS);
+        return 1;
+    }
+
+    return run(opt);
+}
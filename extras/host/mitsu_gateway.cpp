@@ -0,0 +1,486 @@
+/*
+  mitsu_gateway.cpp - Runs MitsuAc controllers for many ttys on a pool of
+  epoll loops
+
+  Usage: mitsu_gateway [--threads N] [--emulate N] [--latency MS]
+                       [--seconds N] [TTY...]
+
+  Each TTY (a USB-UART adapter...) gets a controller, and --emulate adds N
+  pty pairs with a HeatPumpEmulator on the master end of each. Units are
+  sharded by a hash of their tty over --threads worker threads (1 by
+  default), each an epoll loop that sleeps until one of its ttys is
+  readable or its next controller or emulator deadline. A worker with
+  nothing to do steals overdue units from the others.
+
+  Commands are read from stdin as "UNIT JSON" lines and go to the unit's
+  worker through a lock-free queue. Workers publish each unit's state
+  through a seqlock and the main thread prints "UNIT JSON" to stdout when
+  it changes. Stops after --seconds, or on SIGINT/SIGTERM, and prints
+  stats.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "Arduino.h"
+#include "MitsuAc.h"
+#include "HeatPumpEmulator.h"
+#include "PosixSerial.h"
+#include "MpscQueue.h"
+#include "SeqLock.h"
+
+typedef MitsuAcT<PosixSerial> PosixMitsuAc;
+
+// An emulated unit on the master end of a pty
+struct emulated_t {
+    int master;
+    HeatPumpEmulator unit;
+    bool ready;
+};
+
+struct command_t {
+    char json[128];
+};
+
+// What the main thread sees of a unit
+struct snapshot_t {
+    uint32_t generation;
+    MitsuProtocol::settings_t settings;
+    MitsuProtocol::roomTemp_t roomTemp;
+};
+
+struct unit_t {
+    PosixSerial* serial;
+    PosixMitsuAc* ac;
+    emulated_t* emulator;  // NULL for a real tty
+    int shard;
+
+    // Whoever holds busy owns ac, serial and the command queue's head
+    std::atomic<bool> busy;
+    std::atomic<bool> ready;
+    std::atomic<unsigned long> deadline;
+    std::atomic<unsigned long> steals;
+
+    MpscQueue<command_t, 16> commands;
+    SeqLock<snapshot_t> snapshot;
+};
+
+struct shard_t {
+    int ep;
+    int wake; // eventfd, for commands and stopping
+    std::thread thread;
+    std::vector<unit_t*> units;
+    unsigned long wakeups;
+    unsigned long monitors;
+    unsigned long steals;
+};
+
+// epoll_event.data.u64 is the source kind in the top half, index below
+enum source_t { srcUnit = 1, srcEmulator, srcWake };
+
+// How late a unit has to be before another shard takes it, and how often
+// an otherwise idle shard looks
+static const unsigned long STEAL_LATENESS = 5;  // ms
+static const unsigned long STEAL_INTERVAL = 20; // ms
+
+static std::vector<unit_t*> units;
+static std::vector<shard_t*> shards;
+static std::atomic<bool> running(true);
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void stop(int){
+    stopRequested = 1;
+}
+
+static uint64_t epollTag(source_t kind, uint32_t index){
+    return (static_cast<uint64_t>(kind) << 32) | index;
+}
+
+static bool watch(int ep, int fd, source_t kind, uint32_t index){
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = epollTag(kind, index);
+    return epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+// FNV-1a
+static uint32_t hashPath(const char* path){
+    uint32_t h = 2166136261u;
+    for (; *path; path++){
+        h = (h ^ static_cast<uint8_t>(*path)) * 16777619u;
+    }
+    return h;
+}
+
+// A pty pair, returns the master and puts the slave's path in slave
+static int openPty(char* slave, size_t len){
+    int master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (master < 0){
+        return -1;
+    }
+    const char* name;
+    if (grantpt(master) != 0 || unlockpt(master) != 0 || !(name = ptsname(master)) || strlen(name) >= len){
+        close(master);
+        return -1;
+    }
+    strcpy(slave, name);
+    return master;
+}
+
+static void serviceEmulator(emulated_t* em){
+    uint8_t buf[256];
+    ssize_t n;
+    while ((n = read(em->master, buf, sizeof(buf))) > 0){
+        em->unit.receive(buf, n);
+    }
+    size_t len = em->unit.transmit(buf, sizeof(buf));
+    if (len > 0 && write(em->master, buf, len) != static_cast<ssize_t>(len)){
+        fprintf(stderr, "emulator: short write\n");
+    }
+}
+
+// Run a unit if nobody else is, returns false if someone was
+static bool runUnit(unit_t* u){
+    if (u->busy.exchange(true, std::memory_order_acquire)){
+        return false;
+    }
+    command_t cmd;
+    while (u->commands.pop(&cmd)){
+        if (u->ac->putSettingsJson(cmd.json) < 0){
+            fprintf(stderr, "bad settings: %s\n", cmd.json);
+        }
+    }
+    uint32_t generation = u->ac->getGeneration();
+    u->ac->monitor();
+    if (u->ac->getGeneration() != generation){
+        snapshot_t snap;
+        memset(&snap, 0, sizeof(snap));
+        snap.generation = u->ac->getGeneration();
+        u->ac->getSettings(&snap.settings, &snap.roomTemp);
+        u->snapshot.write(snap);
+    }
+    u->deadline.store(u->ac->getNextDeadline(), std::memory_order_relaxed);
+    u->busy.store(false, std::memory_order_release);
+    return true;
+}
+
+// Units of other shards that are well overdue, their own shard is behind
+static unsigned long steal(shard_t* self){
+    unsigned long n = 0;
+    unsigned long now = millis();
+    for (size_t i = 0; i < shards.size(); i++){
+        shard_t* other = shards[i];
+        if (other == self){
+            continue;
+        }
+        for (size_t j = 0; j < other->units.size(); j++){
+            unit_t* u = other->units[j];
+            unsigned long deadline = u->deadline.load(std::memory_order_relaxed);
+            if ((long)(now - deadline) >= (long)STEAL_LATENESS && runUnit(u)){
+                u->steals.fetch_add(1, std::memory_order_relaxed);
+                n++;
+            }
+        }
+    }
+    return n;
+}
+
+static void shardLoop(shard_t* shard){
+    struct epoll_event events[64];
+    bool canSteal = shards.size() > 1;
+
+    while (running.load(std::memory_order_relaxed)){
+        // Sleep until the earliest of our deadlines
+        unsigned long now = millis();
+        unsigned long next = now + (canSteal ? STEAL_INTERVAL : 1000);
+        for (size_t i = 0; i < shard->units.size(); i++){
+            unit_t* u = shard->units[i];
+            unsigned long deadline = u->deadline.load(std::memory_order_relaxed);
+            if ((long)(deadline - next) < 0){
+                next = deadline;
+            }
+            unsigned long due;
+            if (u->emulator && u->emulator->unit.getNextReplyTime(&due) && (long)(due - next) < 0){
+                next = due;
+            }
+        }
+        int timeout = ((long)(next - now) > 0) ? static_cast<int>(next - now) : 0;
+
+        int n = epoll_wait(shard->ep, events, 64, timeout);
+        if (n < 0 && errno != EINTR){
+            perror("epoll_wait");
+            break;
+        }
+        shard->wakeups++;
+        for (int e = 0; e < n; e++){
+            uint32_t index = static_cast<uint32_t>(events[e].data.u64);
+            switch (static_cast<source_t>(events[e].data.u64 >> 32)){
+                case srcUnit:     units[index]->ready.store(true, std::memory_order_relaxed); break;
+                case srcEmulator: units[index]->emulator->ready = true; break;
+                case srcWake: {
+                    uint64_t count;
+                    if (read(shard->wake, &count, sizeof(count)) < 0){
+                        // Already drained
+                    }
+                    break;
+                }
+            }
+        }
+
+        now = millis();
+        bool worked = false;
+        for (size_t i = 0; i < shard->units.size(); i++){
+            unit_t* u = shard->units[i];
+            emulated_t* em = u->emulator;
+            unsigned long due;
+            if (em && (em->ready || (em->unit.getNextReplyTime(&due) && (long)(now - due) >= 0))){
+                em->ready = false;
+                serviceEmulator(em);
+            }
+            if (u->ready.load(std::memory_order_relaxed) ||
+                (long)(now - u->deadline.load(std::memory_order_relaxed)) >= 0){
+                // If another shard has it, stay ready and look again next pass
+                if (runUnit(u)){
+                    u->ready.store(false, std::memory_order_relaxed);
+                    shard->monitors++;
+                    worked = true;
+                }
+            }
+        }
+        if (canSteal && !worked){
+            shard->steals += steal(shard);
+        }
+    }
+}
+
+static void wakeShard(shard_t* shard){
+    uint64_t one = 1;
+    if (write(shard->wake, &one, sizeof(one)) < 0){
+        // Counter full, it's awake anyway
+    }
+}
+
+// "UNIT JSON"
+static void command(char* line){
+    char* json;
+    unsigned long index = strtoul(line, &json, 10);
+    command_t cmd;
+    while (*json == ' '){
+        json++;
+    }
+    if (json == line || index >= units.size() || strlen(json) >= sizeof(cmd.json)){
+        fprintf(stderr, "bad command: %s\n", line);
+        return;
+    }
+    strcpy(cmd.json, json);
+    unit_t* u = units[index];
+    if (!u->commands.push(cmd)){
+        fprintf(stderr, "unit %lu: command queue full\n", index);
+        return;
+    }
+    u->ready.store(true, std::memory_order_relaxed);
+    wakeShard(shards[u->shard]);
+}
+
+static void readCommands(char* buf, size_t* len, size_t size){
+    ssize_t n = read(STDIN_FILENO, buf + *len, size - *len - 1);
+    if (n <= 0){
+        return;
+    }
+    *len += n;
+    buf[*len] = '\0';
+    char* start = buf;
+    char* end;
+    while ((end = strchr(start, '\n'))){
+        *end = '\0';
+        if (*start){
+            command(start);
+        }
+        start = end + 1;
+    }
+    *len -= start - buf;
+    memmove(buf, start, *len);
+    if (*len == size - 1){
+        *len = 0; // Line too long, drop it
+    }
+}
+
+// Print the units whose state moved on since last time
+static void publish(std::vector<uint32_t>& published){
+    for (size_t i = 0; i < units.size(); i++){
+        snapshot_t snap;
+        units[i]->snapshot.read(&snap);
+        if (snap.generation != published[i]){
+            char json[256];
+            published[i] = snap.generation;
+            if (MitsuAcBase::settingsToJson(snap.settings, snap.roomTemp, json, sizeof(json))){
+                printf("%zu %s\n", i, json);
+            }
+        }
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char** argv){
+    unsigned long threads = 1;
+    unsigned long emulate = 0;
+    unsigned long latency = 30;
+    unsigned long seconds = 0;
+    std::vector<const char*> ttys;
+
+    for (int i = 1; i < argc; i++){
+        bool hasValue = (i + 1 < argc);
+        if (hasValue && strcmp(argv[i], "--threads") == 0){ threads = strtoul(argv[++i], NULL, 10); }
+        else if (hasValue && strcmp(argv[i], "--emulate") == 0){ emulate = strtoul(argv[++i], NULL, 10); }
+        else if (hasValue && strcmp(argv[i], "--latency") == 0){ latency = strtoul(argv[++i], NULL, 10); }
+        else if (hasValue && strcmp(argv[i], "--seconds") == 0){ seconds = strtoul(argv[++i], NULL, 10); }
+        else if (argv[i][0] != '-'){ ttys.push_back(argv[i]); }
+        else { threads = 0; break; }
+    }
+#if MITSU_TRACE_LEVEL > MITSU_TRACE_OFF
+    // The trace ring takes records from one thread only
+    if (threads > 1){
+        fprintf(stderr, "%s: built with tracing, --threads must be 1\n", argv[0]);
+        return 1;
+    }
+#endif
+    if (threads == 0){
+        fprintf(stderr, "usage: %s [--threads N] [--emulate N] [--latency MS] [--seconds N] [TTY...]\n", argv[0]);
+        return 1;
+    }
+
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    signal(SIGPIPE, SIG_IGN);
+
+    for (unsigned long i = 0; i < threads; i++){
+        shard_t* shard = new shard_t();
+        shard->ep = epoll_create1(EPOLL_CLOEXEC);
+        shard->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (shard->ep < 0 || shard->wake < 0 || !watch(shard->ep, shard->wake, srcWake, 0)){
+            perror("shard");
+            return 1;
+        }
+        shards.push_back(shard);
+    }
+
+    // Emulated units go after the real ttys, their slaves are ttys like any other
+    size_t realTtys = ttys.size();
+    std::vector<emulated_t*> emulators;
+    std::vector<char*> slaves;
+    for (unsigned long i = 0; i < emulate; i++){
+        char* slave = new char[64];
+        emulated_t* em = new emulated_t();
+        em->master = openPty(slave, 64);
+        if (em->master < 0){
+            perror("pty");
+            return 1;
+        }
+        em->unit.setLatency(latency);
+        em->unit.setSeed(i + 1);
+        em->ready = false;
+        emulators.push_back(em);
+        slaves.push_back(slave);
+        ttys.push_back(slave);
+    }
+    if (ttys.empty()){
+        fprintf(stderr, "%s: no ttys\n", argv[0]);
+        return 1;
+    }
+
+    for (size_t i = 0; i < ttys.size(); i++){
+        unit_t* u = new unit_t();
+        u->serial = new PosixSerial(ttys[i]);
+        u->ac = new PosixMitsuAc(u->serial);
+        u->emulator = (i >= realTtys) ? emulators[i - realTtys] : NULL;
+        u->shard = hashPath(ttys[i]) % shards.size();
+        u->busy.store(false);
+        u->ready.store(false);
+        u->steals.store(0);
+
+        shard_t* shard = shards[u->shard];
+        u->ac->initialize();
+        if (!*u->serial || !watch(shard->ep, u->serial->fd(), srcUnit, i) ||
+            (u->emulator && !watch(shard->ep, u->emulator->master, srcEmulator, i))){
+            fprintf(stderr, "%s: can't open\n", ttys[i]);
+            return 1;
+        }
+        u->deadline.store(u->ac->getNextDeadline());
+        units.push_back(u);
+        shard->units.push_back(u);
+    }
+
+    unsigned long start = millis();
+    for (size_t i = 0; i < shards.size(); i++){
+        shards[i]->thread = std::thread(shardLoop, shards[i]);
+    }
+
+    // The main thread takes commands and publishes state
+    fcntl(STDIN_FILENO, F_SETFL, fcntl(STDIN_FILENO, F_GETFL) | O_NONBLOCK);
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    bool commands = watch(ep, STDIN_FILENO, srcWake, 0);
+    char cmdBuf[1024];
+    size_t cmdLen = 0;
+    std::vector<uint32_t> published(units.size(), 0);
+
+    while (!stopRequested && (!seconds || millis() - start < seconds * 1000)){
+        struct epoll_event ev;
+        int n = epoll_wait(ep, &ev, 1, 50);
+        if (n > 0){
+            if (ev.events & (EPOLLHUP | EPOLLERR)){
+                epoll_ctl(ep, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+                commands = false;
+            }
+            readCommands(cmdBuf, &cmdLen, sizeof(cmdBuf));
+        }
+        publish(published);
+    }
+
+    running.store(false);
+    for (size_t i = 0; i < shards.size(); i++){
+        wakeShard(shards[i]);
+        shards[i]->thread.join();
+    }
+    publish(published);
+
+    unsigned long elapsed = millis() - start;
+    fprintf(stderr, "%zu units, %zu threads, %lu ms%s\n", units.size(), shards.size(), elapsed,
+            commands ? "" : ", stdin closed");
+    for (size_t i = 0; i < shards.size(); i++){
+        fprintf(stderr, "shard %zu: %zu units, %lu wakeups, %lu monitor calls, %lu stolen\n",
+                i, shards[i]->units.size(), shards[i]->wakeups, shards[i]->monitors, shards[i]->steals);
+    }
+    for (size_t i = 0; i < units.size(); i++){
+        char stats[512];
+        units[i]->ac->getStatsJson(stats, sizeof(stats));
+        fprintf(stderr, "%zu %s: shard %d, %lu stolen, %s\n", i, units[i]->serial->path(), units[i]->shard,
+                units[i]->steals.load(), stats);
+    }
+
+    for (size_t i = 0; i < units.size(); i++){
+        delete units[i]->ac;
+        delete units[i]->serial;
+        delete units[i];
+    }
+    for (size_t i = 0; i < emulators.size(); i++){
+        close(emulators[i]->master);
+        delete emulators[i];
+        delete[] slaves[i];
+    }
+    for (size_t i = 0; i < shards.size(); i++){
+        close(shards[i]->ep);
+        close(shards[i]->wake);
+        delete shards[i];
+    }
+    close(ep);
+    return 0;
+}
@@ -0,0 +1,84 @@
+/*
+  mitsu_replay.cpp - Replays a capture through the decoder or a controller
+
+  Usage: mitsu_replay CAPTURE [--controller] [--wall-clock] [--repeat N]
+
+  By default only the packetBuilder is driven, as fast as it goes.
+  --controller drives a whole controller over a host serial port, on a
+  VirtualClock set from the capture's timestamps, and --wall-clock
+  instead runs it on millis() and sleeps out the capture's own timing.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "Arduino.h"
+#include "MitsuAc.h"
+#include "CaptureFile.h"
+
+int main(int argc, char** argv){
+    const char* path = NULL;
+    bool controller = false;
+    bool wallClock = false;
+    int repeat = 1;
+
+    for (int i = 1; i < argc; i++){
+        if (strcmp(argv[i], "--controller") == 0){ controller = true; }
+        else if (strcmp(argv[i], "--wall-clock") == 0){ wallClock = true; controller = true; }
+        else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc){ repeat = atoi(argv[++i]); }
+        else if (!path && argv[i][0] != '-'){ path = argv[i]; }
+        else { path = NULL; break; }
+    }
+    if (!path){
+        fprintf(stderr, "usage: %s CAPTURE [--controller] [--wall-clock] [--repeat N]\n", argv[0]);
+        return 1;
+    }
+
+    CaptureReader reader;
+    if (!reader.open(path)){
+        fprintf(stderr, "%s: not a capture file\n", path);
+        return 1;
+    }
+
+    MitsuProtocol ml;
+    MitsuProtocol::packetBuilder pb(&ml);
+    HardwareSerial serial;
+    MitsuAc wallClockAc(&serial);
+    VirtualMitsuAc ac(&serial);
+    replayStats_t stats;
+    double elapsed = 0.0;
+    unsigned long frames = 0;
+    unsigned long rxBytes = 0;
+
+    for (int r = 0; r < repeat; r++){
+        if (controller){
+            if (wallClock){
+                replayController(&reader, &wallClockAc, &serial, &stats);
+            }else{
+                replayController(&reader, &ac, &serial, &stats);
+            }
+        }else{
+            replayDecoder(&reader, &pb, &stats);
+        }
+        elapsed += stats.elapsedSec;
+        frames += stats.frames;
+        rxBytes += stats.rxBytes;
+    }
+
+    printf("%s: %lu records, %lu rx bytes, %.1f s captured\n",
+           path, stats.records, stats.rxBytes, stats.capturedMs / 1000.0);
+    printf("frames: %lu", stats.frames);
+    if (!controller){
+        for (int k = 0; k < 256; k++){
+            if (stats.frameKinds[k]){
+                printf(", 0x%02x: %lu", k, stats.frameKinds[k]);
+            }
+        }
+    }
+    printf("\n");
+    printf("replayed %d time(s) in %.3f s, %.1f MB/s, %.0f frames/s, %.0fx real time\n",
+           repeat, elapsed,
+           elapsed > 0 ? rxBytes / elapsed / 1e6 : 0.0,
+           elapsed > 0 ? frames / elapsed : 0.0,
+           elapsed > 0 ? (stats.capturedMs / 1000.0) * repeat / elapsed : 0.0);
+    return 0;
+}
@@ -0,0 +1,138 @@
+/*
+  mitsu_sim.cpp - Runs a MitsuAc controller against the heat pump emulator
+
+  Usage: mitsu_sim [--seconds N] [--latency MS] [--ber RATE] [--nok RATE]
+                   [--seed N] [--capture FILE] [--virtual]
+
+  Every few seconds a command is put to the controller, and the settings
+  json is printed with the change mask whenever it changes.
+  --virtual runs on a VirtualClock, as fast as it will go and with the
+  same output every run for the same options.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "Arduino.h"
+#include "MitsuAc.h"
+#include "HeatPumpEmulator.h"
+#include "CaptureFile.h"
+#include "VirtualClock.h"
+
+static const char* commands[] = {
+    "{\"pwr\":\"on\",\"mode\":\"heat\",\"fan\":\"2\",\"vane\":\"3\",\"wdvane\":\"center\",\"stemp\":23}",
+    "{\"pwr\":\"on\",\"mode\":\"cool\",\"fan\":\"auto\",\"vane\":\"swing\",\"wdvane\":\"swing\",\"stemp\":19}",
+    "{\"pwr\":\"off\",\"mode\":\"auto\",\"fan\":\"quiet\",\"vane\":\"auto\",\"wdvane\":\"half_left\",\"stemp\":21}"
+};
+
+struct options_t {
+    unsigned long seconds;
+    unsigned long latency;
+    double ber;
+    double nok;
+    uint32_t seed;
+    const char* capturePath;
+};
+
+// The real clock sleeps between passes, the virtual one just moves on
+static void pass(MitsuClock*){
+    delay(1);
+}
+
+static void pass(VirtualClock*){
+    VirtualClock::advance(1);
+}
+
+template <typename Clock>
+static int simulate(const options_t& opt){
+    const char* capturePath = opt.capturePath;
+    unsigned long seconds = opt.seconds;
+
+    HardwareSerial serial;
+    HeatPumpEmulator unit;
+    unit.setLatency(opt.latency);
+    unit.setBitErrorRate(opt.ber);
+    unit.setNokRate(opt.nok);
+    unit.setSeed(opt.seed);
+    unit.setClock(Clock::now);
+
+    MitsuAcT<HardwareSerial, MitsuTiming, Clock> ac(&serial);
+
+    MitsuCapture::record_t ring[64];
+    MitsuCapture capture(ring, 64);
+    CaptureWriter writer;
+    if (capturePath){
+        if (!writer.open(capturePath)){
+            fprintf(stderr, "%s: can't write capture\n", capturePath);
+            return 1;
+        }
+        ac.setCapture(&capture);
+    }
+
+    ac.initialize();
+
+    unsigned long wallStart = millis();
+    unsigned long start = Clock::now();
+    ac.setChangeCb([&](uint16_t changes){
+        char json[256];
+        ac.getSettingsJson(json, sizeof(json));
+        printf("%8lu ms %04x %s\n", Clock::now() - start, changes, json);
+    });
+    unsigned long lastCommand = start;
+    int nextCommand = 0;
+
+    while (Clock::now() - start < seconds * 1000){
+        unit.service(&serial);
+        ac.monitor();
+
+        if (Clock::now() - lastCommand > 5000){
+            // A slider drag, then the command
+            for (int t = 16; t <= 31; t++){
+                char drag[32];
+                sprintf(drag, "{\"stemp\":%d}", t);
+                ac.putSettingsJson(drag);
+            }
+            ac.putSettingsJson(commands[nextCommand]);
+            nextCommand = (nextCommand + 1) % 3;
+            lastCommand = Clock::now();
+        }
+
+        writer.drain(&capture);
+        MitsuTrace::drain([](const char* msg){ printf("  trace %s\n", msg); });
+        pass(static_cast<Clock*>(NULL));
+    }
+
+    printf("controller: %lu commands coalesced, round trips: settings info %lu ms, room temp %lu ms, settings %lu ms\n",
+           ac.getCoalescedCommands(),
+           ac.getRoundTripTime(MitsuAc::reqSettingsInfo),
+           ac.getRoundTripTime(MitsuAc::reqRoomTempInfo),
+           ac.getRoundTripTime(MitsuAc::reqSettings));
+    char stats[512];
+    ac.getStatsJson(stats, sizeof(stats));
+    printf("stats: %s\n", stats);
+    printf("unit: %lu frames in, %lu frames out, %lu bad frames, %lu bit errors, %lu settings refused\n",
+           unit.framesReceived, unit.framesSent, unit.badFrames, unit.bitErrors, unit.settingsRefused);
+    printf("ran %lu s in %lu ms\n", seconds, millis() - wallStart);
+    return 0;
+}
+
+int main(int argc, char** argv){
+    options_t opt = {20, 30, 0.0, 0.0, 1, NULL};
+    bool virtualClock = false;
+
+    for (int i = 1; i < argc; i++){
+        bool hasValue = (i + 1 < argc);
+        if (strcmp(argv[i], "--virtual") == 0){ virtualClock = true; }
+        else if (hasValue && strcmp(argv[i], "--seconds") == 0){ opt.seconds = strtoul(argv[++i], NULL, 10); }
+        else if (hasValue && strcmp(argv[i], "--latency") == 0){ opt.latency = strtoul(argv[++i], NULL, 10); }
+        else if (hasValue && strcmp(argv[i], "--ber") == 0){ opt.ber = atof(argv[++i]); }
+        else if (hasValue && strcmp(argv[i], "--nok") == 0){ opt.nok = atof(argv[++i]); }
+        else if (hasValue && strcmp(argv[i], "--seed") == 0){ opt.seed = strtoul(argv[++i], NULL, 10); }
+        else if (hasValue && strcmp(argv[i], "--capture") == 0){ opt.capturePath = argv[++i]; }
+        else {
+            fprintf(stderr, "usage: %s [--seconds N] [--latency MS] [--ber RATE] [--nok RATE] [--seed N] [--capture FILE] [--virtual]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    return virtualClock ? simulate<VirtualClock>(opt) : simulate<MitsuClock>(opt);
+}
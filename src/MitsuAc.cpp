@@ -18,264 +18,338 @@
   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 */
 #include "MitsuAc.h"
-#include <ArduinoJson.h>
 
+MitsuAcBase::MitsuAcBase() {
+  memset(inFlight, 0, sizeof(inFlight));
+  resetStats();
+}
+
+void MitsuAcBase::setCapture(MitsuCapture* capture){
+  this->capture = capture;
+}
 
-#ifdef DEBUG_ON
-void MitsuAc::log (const char* msg){
-    if (debugCb){
-        debugCb (msg);
+// The frame for a request of kind, 0 if there's nothing to send
+int MitsuAcBase::buildRequest(request_t kind, uint8_t* buf){
+    int len = 0;
+    switch (kind){
+        case reqConnect:
+            len = ml.getTxConnectPacket(buf);
+            break;
+        case reqSettingsInfo:
+            len = ml.getTxInfoPacket(buf, MitsuProtocol::settings);
+            break;
+        case reqRoomTempInfo:
+            len = ml.getTxInfoPacket(buf, MitsuProtocol::roomTemp);
+            break;
+        case reqSettings:
+            // Once the unit's settings are known only send what differs,
+            // unchanged vanes make some units re-beep and settle slower
+            if (firstRxSettingsReceived){
+                len = ml.getTxSettingsPacket(buf, targetSettings, lastSettings);
+            }else{
+                len = ml.getTxSettingsPacket(buf, targetSettings);
+            }
+            break;
+        default:
+            break;
+    }
+    return len;
+}
+
+void MitsuAcBase::completeRequest(request_t kind, unsigned long now){
+    inFlight_t& req = inFlight[kind];
+    if (req.active){
+        req.active = false;
+        req.roundTripTime = now - req.sentAt;
+        addToHistogram(stats.roundTripTime, req.roundTripTime);
     }
 }
-void MitsuAc::setDebugCb(DEBUG_CB){
-    this->debugCb = debugCb;
-    ml.setDebugCb(debugCb);
+
+unsigned long MitsuAcBase::getRoundTripTime(request_t kind){
+    return (kind < REQUEST_KINDS) ? inFlight[kind].roundTripTime : 0;
+}
+
+bool MitsuAcBase::isInFlight(request_t kind){
+    return (kind < REQUEST_KINDS) && inFlight[kind].active;
 }
-void MitsuAc::sendPkt(uint8_t* data, size_t len){
-    uint8_t buf[64] =  {0};
-    memcpy(buf,data,len);
-    
-    // Put a checksum on the end
-    uint8_t sum = 0;
-    for (int i = 0; i < len; i++) {
-        sum += data[i];
+
+static const unsigned long histogramBounds[MitsuAcBase::HISTOGRAM_BUCKETS - 1] = {50, 100, 200, 400, 800, 1600, 3200};
+
+void MitsuAcBase::addToHistogram(uint32_t* histogram, unsigned long ms){
+    int i = 0;
+    while (i < HISTOGRAM_BUCKETS - 1 && ms > histogramBounds[i]){
+        i++;
     }
-    buf[len] = (0xfc - sum) & 0xff;    
+    histogram[i]++;
+}
+
+void MitsuAcBase::getStats(stats_t* stats){
+    *stats = this->stats;
+    stats->rx = pb.getStats();
+}
 
-    sendData (buf,len+1);
-    
-    
+void MitsuAcBase::resetStats(){
+    memset(&stats, 0, sizeof(stats));
+    pb.resetStats();
+}
+
+size_t MitsuAcBase::getStatsJson(char* json, size_t len){
+    stats_t s;
+    getStats(&s);
+
+    MitsuProtocol::jsonWriter w(json, len);
+    w.beginObject();
+    w.key("rx");
+    w.beginObject();
+    w.key("bytes");      w.integer(s.rx.bytes);
+    w.key("skipped");    w.integer(s.rx.bytesSkipped);
+    w.key("resyncs");    w.integer(s.rx.headerResyncs);
+    w.key("badLength");  w.integer(s.rx.lengthErrors);
+    w.key("badChecksum"); w.integer(s.rx.checksumFailures);
+    w.key("overflows");  w.integer(s.rx.overflows);
+    w.key("frames");
+    w.beginObject();
+    for (int i = 0; i < MitsuProtocol::MSG_KIND_COUNT; i++){
+        w.key(MitsuProtocol::msgKindName(i));
+        w.integer(s.rx.frames[i]);
+    }
+    w.endObject();
+    w.endObject();
+    w.key("tx");
+    w.beginObject();
+    w.key("bytes");      w.integer(s.bytesTx);
+    w.key("frames");     w.integer(s.framesTx);
+    w.key("dropped");    w.integer(s.framesTxDropped);
+    w.endObject();
+    w.key("reinits");    w.integer(s.reinits);
+    w.key("retransmits"); w.integer(s.settingsRetransmits);
+    w.key("noks");       w.integer(s.settingsNoks);
+    w.key("retries");    w.integer(s.requestRetries);
+    w.key("timeouts");   w.integer(s.requestTimeouts);
+    w.key("rtt");
+    w.beginArray();
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++){
+        w.integer(s.roundTripTime[i]);
+    }
+    w.endArray();
+    w.key("confirm");
+    w.beginArray();
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++){
+        w.integer(s.commandToConfirmTime[i]);
+    }
+    w.endArray();
+    w.endObject();
+    return w.finish();
 }
-#endif
-/* END DEBUG */
 
-MitsuAc::MitsuAc(HardwareSerial *serial) {
-  _HardSerial = serial;
+size_t MitsuAcBase::getSettingsJson(char* jsonSettings, size_t len){
+   return settingsToJson(lastSettings, lastRoomTemp, jsonSettings, len);
 }
 
-void MitsuAc::initialize(){
-  _HardSerial->begin(2400, SERIAL_8E1);
-  delay(1000);
-  firstRxSettingsReceived = false;
-  sendInit();
+void MitsuAcBase::getSettings(MitsuProtocol::settings_t* settings, MitsuProtocol::roomTemp_t* roomTemp){
+   *settings = lastSettings;
+   *roomTemp = lastRoomTemp;
 }
 
-void MitsuAc::sendRequestInfo(MitsuProtocol::info_t kind){
-    uint8_t buf[32] = {0};
-    int len = ml.getTxInfoPacket (buf, kind);
-    sendData (buf, len);
-    lastTxInfoRequestTime = millis();
+size_t MitsuAcBase::settingsToJson(const MitsuProtocol::settings_t& settings, const MitsuProtocol::roomTemp_t& roomTemp,
+                                   char* jsonSettings, size_t len){
+   MitsuProtocol::jsonWriter json(jsonSettings, len);
+   settingsToJson(settings, roomTemp, json);
+   return json.finish();
 }
 
-void MitsuAc::sendInit() {
-  uint8_t buf[16] = {0};
-  int len = ml.getTxConnectPacket (buf);
-  sendData(buf, len);
-  lastTxInitTime = millis();
+void MitsuAcBase::settingsToJson(const MitsuProtocol::settings_t& settings, const MitsuProtocol::roomTemp_t& roomTemp,
+                                 MitsuProtocol::jsonWriter& json){
+   json.beginObject();
+   json.key("pwr");
+   json.string(MitsuProtocol::power_tToString(settings.power));
+   json.key("mode");
+   json.string(MitsuProtocol::mode_tToString(settings.mode));
+   json.key("fan");
+   json.string(MitsuProtocol::fan_tToString(settings.fan));
+   json.key("vane");
+   json.string(MitsuProtocol::vane_tToString(settings.vane));
+   json.key("wdvane");
+   json.string(MitsuProtocol::wideVane_tToString(settings.wideVane));
+   json.key("stemp");
+   json.integer(settings.tempDegC);
+   json.key("rtemp");
+   json.integer(roomTemp.roomTemp);
+   json.key("rtemp1");
+   json.fixed1(roomTemp.tempSens1Raw);
+   json.key("rtemp2");
+   json.fixed1(roomTemp.tempSens2Raw);
+   json.endObject();
 }
 
-void MitsuAc::getSettingsJson(char* jsonSettings){
-   char buf[16];
-   strcpy(jsonSettings, "{\"pwr\":\""); 
-   strcat(jsonSettings, ml.power_tToString(lastSettings.power));
-   strcat(jsonSettings, "\",\"mode\":\"");
-   strcat(jsonSettings, ml.mode_tToString(lastSettings.mode));
-   strcat(jsonSettings, "\",\"fan\":\"");
-   strcat(jsonSettings, ml.fan_tToString(lastSettings.fan));
-   strcat(jsonSettings, "\",\"vane\":\"");
-   strcat(jsonSettings, ml.vane_tToString(lastSettings.vane));
-   strcat(jsonSettings, "\",\"wdvane\":\"");
-   strcat(jsonSettings, ml.wideVane_tToString(lastSettings.wideVane));
-   strcat(jsonSettings, "\",\"stemp\":");
-   itoa(lastSettings.tempDegC,buf,10);
-   strcat(jsonSettings, buf);
-   strcat(jsonSettings, ",\"rtemp\":");
-   itoa(lastRoomTemp.roomTemp,buf,10);
-   strcat(jsonSettings, buf);
-   strcat(jsonSettings, ",\"rtemp1\":");     
-   dtostrf(lastRoomTemp.tempSens1Raw, 4, 1, buf);  
-   strcat(jsonSettings, buf);
-   strcat(jsonSettings, ",\"rtemp2\":");
-   dtostrf(lastRoomTemp.tempSens2Raw, 4, 1, buf);   
-   strcat(jsonSettings, buf);
-   strcat(jsonSettings, "}");
+unsigned long MitsuAcBase::getGeneration(){
+   return generation;
 }
 
-int MitsuAc::putSettingsJson(const char* jsonSettings){
-    StaticJsonBuffer<256> jsonBuffer;
-    JsonObject& root = jsonBuffer.parseObject(jsonSettings);
-    //MitsuProtocol::settings_t targetSettings = ml.emptySettings;
-    bool success=false;
-    bool msgOk = true;
-    
-    if (root.containsKey("pwr") && root["pwr"].is<const char*>()){
-      ml.power_tFromString(root["pwr"],&targetSettings.power,success);
-      targetSettings.powerValid = true;
-      msgOk = (msgOk & success);
-    }else{
-      targetSettings.powerValid = false;
-      msgOk = false;
+void MitsuAcBase::setChangeCb(CHANGE_CB){
+   this->changeCb = changeCb;
+}
+
+void MitsuAcBase::notifyChanges(uint16_t changes){
+   if (changes){
+      generation++;
+      if (changeCb){
+         changeCb(changes);
+      }
+   }
+}
+
+void MitsuAcBase::setRxCb(RX_CB){
+   this->rxCb = rxCb;
+}
+
+void MitsuAcBase::requestInfo(MitsuProtocol::info_t kind){
+   if (kind == MitsuProtocol::settings){
+      settingsReadbackDue = true;
+   }else{
+      roomTempReadbackDue = true;
+   }
+}
+
+bool MitsuAcBase::isTargetAchieved(){
+   return firstRxSettingsReceived && pendingCommands == 0 && targetSettingsAchieved;
+}
+
+int MitsuAcBase::queueCommand(const char* jsonSettings, unsigned long now){
+    MitsuProtocol::settings_t command;
+    if (!ml.settingsFromJson(jsonSettings, &command)){
+        return -1;
     }
-    if (root.containsKey("mode") && root["mode"].is<const char*>()){
-      ml.mode_tFromString(root["mode"],&targetSettings.mode,success);
-      msgOk = (msgOk & success);
-      targetSettings.modeValid = true;
-    }else{
-      msgOk = false;
-      targetSettings.modeValid = false;
+    queueSettings(command, now);
+    return 0;
+}
+
+void MitsuAcBase::queueSettings(const MitsuProtocol::settings_t& command, unsigned long now){
+    if (!command.valid){
+        return; // Nothing to change
     }
-    if (root.containsKey("fan")){
-      ml.fan_tFromString(root["fan"],&targetSettings.fan,success);
-      msgOk = (msgOk & success);
-      targetSettings.fanValid = true;
-    }else{
-      msgOk = false;
-      targetSettings.fanValid = false;
-    }    
-    if (root.containsKey("vane") && root["vane"].is<const char*>()){
-      ml.vane_tFromString(root["vane"],&targetSettings.vane,success);
-      msgOk = (msgOk & success);
-      targetSettings.vaneValid = true;
-    }else{
-      msgOk = false;
-      targetSettings.vaneValid = false;
-    }    
-    if (root.containsKey("wdvane") && root["wdvane"].is<const char*>()){
-      ml.wideVane_tFromString(root["wdvane"],&targetSettings.wideVane,success);
-      msgOk = (msgOk & success);
-      targetSettings.wideVaneValid = true;
-    }else{
-      msgOk = false;
-      targetSettings.wideVaneValid = false;
-    }    
-    if (root.containsKey("stemp") && root["stemp"].is<int>()){
-      targetSettings.tempDegC = root["stemp"];
-      targetSettings.tempDegCValid = true;
-    }else{
-      msgOk = false;
-      targetSettings.tempDegCValid = false;
+
+    // Start afresh once the last target was reached, so settings
+    // changed at the unit since aren't sent back to it
+    if (pendingCommands == 0 && targetSettingsAchieved){
+        targetSettings = MitsuProtocol::emptySettings;
     }
-    
+    ml.merge(&targetSettings, command);
     targetSettingsAchieved = false;
+    if (!awaitingConfirm){
+        awaitingConfirm = true;
+        commandTime = now;
+    }
+    pendingCommands++;
+}
 
-    uint8_t buf[32];
-    int len = ml.getTxSettingsPacket(buf, targetSettings);
-    sendData (buf,len);
-    lastTxSettingsTime = millis();
+int MitsuAcBase::getPendingCommands(){
+    return pendingCommands;
+}
 
-    return msgOk?0:-1;
+unsigned long MitsuAcBase::getCoalescedCommands(){
+    return coalescedCommands;
 }
 
-void MitsuAc::monitor() {
-  // Service the serial port
-  while (_HardSerial->available() > 0){
-    pb.addByte(_HardSerial->read());
-    if (pb.complete() && pb.valid()) {
-        MitsuProtocol::msg_t msg = pb.getData();
-        if (msg.msgKindValid){
-            switch (msg.kind){
-                case MitsuProtocol::msgKind_t::rxCurrentSettings:
-                    storeRxSettings(msg.data.rxCurrentSettingsData);
-                    break;
-            }
+// Protected Methods
+void MitsuAcBase::handleMsg(const MitsuProtocol::msg_t& msg, unsigned long now){
+    lastRxTime = now;
+    if (msg.msgKindValid){
+        switch (msg.kind){
+            case MitsuProtocol::msgKind_t::rxCurrentSettings:
+                completeRequest(msg.data.rxCurrentSettingsData.kind == MitsuProtocol::settings ?
+                                reqSettingsInfo : reqRoomTempInfo, now);
+                storeRxSettings(msg.data.rxCurrentSettingsData, now);
+                break;
+            case MitsuProtocol::msgKind_t::rxStatusOk:
+                // Confirm the settings with a readback rather than waiting
+                // for the next poll
+                if (inFlight[reqSettings].active){
+                    settingsReadbackDue = true;
+                }
+                completeRequest(reqSettings, now);
+                break;
+            case MitsuProtocol::msgKind_t::rxStatusNok:
+                // The unit answers a connect with 0x7a, and refuses a
+                // settings frame with it
+                if (inFlight[reqSettings].active && !inFlight[reqConnect].active){
+                    MITSU_TRACE_EVENT(MitsuTrace::settingsNok, NULL, 0);
+                    stats.settingsNoks++;
+                    settingsRefused = true;
+                    completeRequest(reqSettings, now);
+                }else{
+                    completeRequest(reqConnect, now);
+                }
+                break;
+            default:
+                break;
         }
-        pb.reset();
-    }
-  }
-  
-  switch (currentState){
-
-      case (INFO_REQ):
-         // If no infos are being received, trigger an init packet
-         if (((millis() - lastRxSettingsTime) > (MIN_INFO_REQ_WAIT_TIME * 10)) && 
-             ((millis() - lastRxRoomTempTime) > (MIN_INFO_REQ_WAIT_TIME * 10)) &&
-             ((millis() - lastTxInitTime) > MIN_CONNECTION_WAIT_TIME) &&
-             ((millis() - lastTxTime) > MIN_TX_DELAY_WAIT_TIME)) {
-            firstRxSettingsReceived = false;
-            sendInit();
-         }
-         else if (((millis() - lastTxInfoRequestTime) > MIN_INFO_REQ_WAIT_TIME) &&
-                  ((millis() - lastTxTime) > MIN_TX_DELAY_WAIT_TIME)){
-             MitsuProtocol::info_t thisInfo = lastInfo==MitsuProtocol::settings ? MitsuProtocol::roomTemp : MitsuProtocol::settings;
-             sendRequestInfo(thisInfo);
-             lastInfo = thisInfo;
-         }   
-         currentState = SETTINGS;
-         break;
-      
-      case (SETTINGS):
-      
-         // Check the target settings against the latest settings
-         if (firstRxSettingsReceived &&
-             !targetSettingsAchieved &&
-             (!ml.equals(targetSettings, lastSettings)) && 
-             ((millis() - lastTxSettingsTime) > MIN_SETTINGS_WAIT_TIME) &&
-             ((millis() - lastTxTime) > MIN_TX_DELAY_WAIT_TIME)){
-             uint8_t buf[32];
-             int len = ml.getTxSettingsPacket(buf, targetSettings);
-             sendData (buf,len);
-             lastTxSettingsTime = millis();
-         }
-         currentState = INFO_REQ;
-         break;
     }
 }
 
-// Private Methods
-void MitsuAc::sendData(uint8_t* buf, int len){
-    #ifdef DEBUG_CALLS
-    log ("MitsuAc::sendData()");
-    #endif
-    #ifdef DEBUG_PACKETS
-    char dmsg[256];
-    strcpy (dmsg,"Tx Pkt: [");
-    for(int i = 0; i < len; i++) {
-        strcat(dmsg,"0x");
-        char dbuf[8];
-        if (buf[i]<=0x0f){strcat(dmsg,"0");}
-        strcat(dmsg, itoa(buf[i],dbuf,16));
-        if (i==4){strcat(dmsg,"]");};
-        strcat(dmsg," ");
-    }
-    log(dmsg);
-    #endif
-
-    if (_HardSerial){
-        for(int i = 0; i < len; i++) {
-          #ifdef DEBUG_BYTES
-          char dmsg[16];
-          strcpy (dmsg,"Tx: 0x");
-          char dbuf[8];
-          strcat(dmsg, itoa(buf[i],dbuf,16));
-          log(dmsg);    
-          #endif
-          _HardSerial->write((uint8_t)buf[i]);
-        }
+bool MitsuAcBase::queueFrame(const uint8_t* buf, int len, request_t request){
+    // Queue the frame, monitor() puts it on the line when the line is free
+    if (txCount == TX_QUEUE_FRAMES || len > TX_FRAME_SIZE){
+        MITSU_TRACE_EVENT(MitsuTrace::txDropped, buf, len);
+        stats.framesTxDropped++;
+        return false;
     }
-    lastTxTime = millis();
+    txFrame_t& frame = txQueue[(txHead + txCount) % TX_QUEUE_FRAMES];
+    memcpy(frame.data, buf, len);
+    frame.len = len;
+    frame.request = request;
+    txCount++;
+    return true;
 }
 
-void MitsuAc::storeRxSettings(MitsuProtocol::rxSettings_t settings){
+void MitsuAcBase::storeRxSettings(MitsuProtocol::rxSettings_t settings, unsigned long now){
+    uint16_t changes = 0;
     switch (settings.kind){
         case MitsuProtocol::info_t::settings:
+            changes = firstRxSettingsReceived ? ml.diff(lastSettings, settings.data.settings) : static_cast<uint16_t>(changeSettings);
             lastSettings = settings.data.settings;
-            lastRxSettingsTime = millis();
+            lastRxSettingsTime = now;
             
             if(!firstRxSettingsReceived){
                 firstRxSettingsReceived = true;
-                targetSettings = settings.data.settings;
+                if (pendingCommands > 0 || settingsRefused || awaitingConfirm){
+                    // Keep the commands not yet seen at the unit, its own
+                    // values only fill in the fields they leave out
+                    MitsuProtocol::settings_t target = settings.data.settings;
+                    ml.merge(&target, targetSettings);
+                    targetSettings = target;
+                }else{
+                    targetSettings = settings.data.settings;
+                }
             }
             
-            if (ml.equals(targetSettings, lastSettings)){
+            // Commands still queued can't have been achieved yet
+            if (pendingCommands == 0 && ml.equals(targetSettings, lastSettings)){
                 // Target settings achieved, stop monitoring it
                 targetSettingsAchieved = true;
+                if (awaitingConfirm){
+                    awaitingConfirm = false;
+                    addToHistogram(stats.commandToConfirmTime, now - commandTime);
+                }
             }
 			   
             break;
         case MitsuProtocol::info_t::roomTemp :
+            if (lastRoomTemp.roomTemp != settings.data.roomTemp.roomTemp){
+                changes |= changeRoomTemp;
+            }
+            if (lastRoomTemp.tempSens1Raw != settings.data.roomTemp.tempSens1Raw){
+                changes |= changeTempSens1;
+            }
+            if (lastRoomTemp.tempSens2Raw != settings.data.roomTemp.tempSens2Raw){
+                changes |= changeTempSens2;
+            }
             lastRoomTemp = settings.data.roomTemp;
-			   lastRxRoomTempTime = millis();
+			   lastRxRoomTempTime = now;
             break;
     }
+    notifyChanges(changes);
+    if (rxCb){
+        rxCb(settings.kind);
+    }
 }
-
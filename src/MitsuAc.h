@@ -17,63 +17,200 @@
   License along with this library; if not, write to the Free Software
   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 */
-//#ifndef __MitsuAc_H__
+#ifndef __MitsuAc_H__
 #define __MitsuAc_H__
 #include <HardwareSerial.h>
 #include "Arduino.h"
 #include "MitsuProtocol.h"
+#include "MitsuCapture.h"
 
-class MitsuAc
+#if defined(ESP8266) || !defined(ARDUINO)
+#define CHANGE_CB std::function<void(uint16_t changes)> changeCb
+#define RX_CB std::function<void(MitsuProtocol::info_t kind)> rxCb
+#else
+#define CHANGE_CB void (*changeCb)(uint16_t changes)
+#define RX_CB void (*rxCb)(MitsuProtocol::info_t kind)
+#endif
+
+/*
+Timing policy - how long MitsuAcT waits for and between things, all ms.
+Derive from it and override what differs to make another one:
+
+  struct SlowUnitTiming : MitsuTiming {
+      static constexpr unsigned long REQUEST_TIMEOUT = 600;
+  };
+*/
+struct MitsuTiming
+{
+    static constexpr unsigned long MIN_INFO_REQ_WAIT_TIME   = 500;
+    static constexpr unsigned long MIN_CONNECTION_WAIT_TIME = 5000;
+    static constexpr unsigned long MIN_SETTINGS_WAIT_TIME   = 500;
+    static constexpr unsigned long MIN_TX_DELAY_WAIT_TIME   = 200;  // must be less than the above
+    static constexpr unsigned long MIN_RESPONSE_GAP_TIME    = 50;   // after a reply before the next request
+    static constexpr unsigned long REQUEST_TIMEOUT          = 300;  // for a reply once the request is on the wire
+    static constexpr int MAX_REQUEST_RETRIES                = 2;
+    static constexpr unsigned long SETTLE_TIME              = 1000; // after initialize() before the first frame
+};
+
+/*
+Clock policy - where MitsuAcT gets the time from, a static now() in ms
+that wraps like millis(). A host build can swap in a simulated clock.
+*/
+struct MitsuClock
+{
+    static unsigned long now(){
+        return millis();
+    }
+};
+
+/*
+Transport - anything with HardwareSerial's available(), availableForWrite(),
+readBytes(uint8_t*, size_t) and write(const uint8_t*, size_t). Specialise
+this for one that's opened differently, e.g. a SoftwareSerial without a
+config argument. A frame is only written once txRoom() is at least its
+length, so a SoftwareSerial, whose availableForWrite() is 0 or 1, must
+specialise txRoom() too or nothing is ever sent.
+*/
+template <typename Transport>
+struct MitsuTransportTraits
+{
+    static void begin(Transport* transport, unsigned long baud){
+        transport->begin(baud, SERIAL_8E1);
+    }
+
+    // Bytes write() takes now without blocking
+    static int txRoom(Transport* transport){
+        return transport->availableForWrite();
+    }
+};
+
+/*
+MitsuAcBase Class -
+The controller's state and everything that doesn't touch the transport
+or the clock, so it's compiled once rather than per MitsuAcT.
+*/
+class MitsuAcBase
 {
   public:
-    // Constructor
-    MitsuAc(HardwareSerial *serial);
-       
-    // Start the serial and trigger an init packet to the unit
-    void initialize();
-    
-    // Monitor the unit, call this regularly in the main loop
-    void monitor();
-    
-    // Get current settings, json encoded
-    void getSettingsJson(char* jsonSettings);
+    // Change mask bits, the settings bits match MitsuProtocol::control_t
+    enum change_t {
+        changePower     = MitsuProtocol::control_t::power,
+        changeMode      = MitsuProtocol::control_t::mode,
+        changeTemp      = MitsuProtocol::control_t::temp,
+        changeFan       = MitsuProtocol::control_t::fan,
+        changeVane      = MitsuProtocol::control_t::vane,
+        changeWideVane  = MitsuProtocol::control_t::wideVane,
+        changeRoomTemp  = 0x0100,
+        changeTempSens1 = 0x0200,
+        changeTempSens2 = 0x0400,
+        changeSettings  = 0x00ff
+    };
+
+    // Requests that get a reply from the unit
+    enum request_t {
+        reqConnect,
+        reqSettingsInfo,
+        reqRoomTempInfo,
+        reqSettings,
+        REQUEST_KINDS,
+        reqNone = REQUEST_KINDS
+    };
+
+    // Counters and latency histograms, since construction or resetStats().
+    // Histogram buckets hold times up to 50, 100, 200, 400, 800, 1600,
+    // 3200 ms and above
+    static const int HISTOGRAM_BUCKETS = 8;
+    struct stats_t {
+        MitsuProtocol::packetBuilder::stats_t rx;
+        uint32_t bytesTx;
+        uint32_t framesTx;
+        uint32_t framesTxDropped;     // Tx queue full
+        uint32_t reinits;             // Connect frames sent
+        uint32_t settingsRetransmits; // Target not reached, sent again
+        uint32_t settingsNoks;        // Settings frames refused by the unit
+        uint32_t requestRetries;      // Resent after missing a deadline
+        uint32_t requestTimeouts;     // Given up on after the retries
+        uint32_t roundTripTime[HISTOGRAM_BUCKETS];
+        uint32_t commandToConfirmTime[HISTOGRAM_BUCKETS];
+    };
+
+    // Get current settings, json encoded. Returns the length written,
+    // 0 if it didn't fit in len bytes
+    size_t getSettingsJson(char* jsonSettings, size_t len);
+
+    // The last known settings and room temperature, and the json
+    // getSettingsJson makes of them, for callers that keep copies
+    void getSettings(MitsuProtocol::settings_t* settings, MitsuProtocol::roomTemp_t* roomTemp);
+    static size_t settingsToJson(const MitsuProtocol::settings_t& settings, const MitsuProtocol::roomTemp_t& roomTemp,
+                                 char* jsonSettings, size_t len);
+    static void settingsToJson(const MitsuProtocol::settings_t& settings, const MitsuProtocol::roomTemp_t& roomTemp,
+                               MitsuProtocol::jsonWriter& json);
+
+    // Bumped whenever the settings or room temperature change, so
+    // callers can skip getSettingsJson when nothing is new
+    unsigned long getGeneration();
+
+    // Called with the change_t mask of what changed, only when something did
+    void setChangeCb(CHANGE_CB);
+
+    // Called with the kind of every info received from the unit, changed
+    // or not, from within monitor()
+    void setRxCb(RX_CB);
+
+    // Ask for an info at the next free slot, ahead of the regular polls
+    void requestInfo(MitsuProtocol::info_t kind);
+
+    // Whether the unit has been seen with all the settings put so far
+    bool isTargetAchieved();
     
-    // Put immediately the requested settings
-    int putSettingsJson(const char* jsonSettings);
+    // Commands merged into the frame waiting to be sent
+    int getPendingCommands();
+    // Commands that were merged into another's frame since initialize()
+    unsigned long getCoalescedCommands();
 
-    #ifdef DEBUG_ON
-    void setDebugCb(DEBUG_CB);
-    void sendPkt(uint8_t data[], size_t len);
-    #endif
+    // Round trip time of the last answered request of kind, ms from the
+    // frame going on the wire to its reply being decoded
+    unsigned long getRoundTripTime(request_t kind);
+    // Whether a request of kind is waiting for its reply
+    bool isInFlight(request_t kind);
 
-  private:
-    #ifdef DEBUG_ON
-    void log (const char* msg);
-    DEBUG_CB;
-    #endif
+    // Link statistics, as a struct or json encoded. getStatsJson returns
+    // the length written, 0 if it didn't fit in len bytes
+    void getStats(stats_t* stats);
+    size_t getStatsJson(char* json, size_t len);
+    void resetStats();
+
+    // Record serial traffic into capture, NULL to stop
+    void setCapture(MitsuCapture* capture);
+
+  protected:
+    MitsuAcBase();
 
 	 // Constants
-	 const int MIN_INFO_REQ_WAIT_TIME   = 500;  //ms 
-	 const int MIN_CONNECTION_WAIT_TIME = 5000; //ms
-	 const int MIN_SETTINGS_WAIT_TIME   = 500;  //ms 
-	 const int MIN_TX_DELAY_WAIT_TIME   = 200;  //ms - must be less than the above
+	 static const unsigned long BAUD = 2400;
+	 static const int BITS_PER_BYTE = 11;  // 8E1 - start, 8 data, parity, stop
+	 static const int RX_CHUNK_SIZE = 32;  // bytes read from the serial at a time
+	 static const int RX_CHUNK_MSGS = RX_CHUNK_SIZE / MitsuProtocol::packetBuilder::MIN_PACKET_LEN + 1;
     
     // Protocol objects
     MitsuProtocol ml = MitsuProtocol();
     MitsuProtocol::packetBuilder pb = MitsuProtocol::packetBuilder(&ml);
     
-    // Private Methods
-	 void sendInit();
-    void sendRequestInfo(MitsuProtocol::info_t kind);
-    void storeRxSettings(MitsuProtocol::rxSettings_t settings);
+    // Protected Methods, now is the clock's time in ms
+    int buildRequest(request_t kind, uint8_t* buf);
+    int queueCommand(const char* jsonSettings, unsigned long now);
+    void queueSettings(const MitsuProtocol::settings_t& command, unsigned long now);
+    void completeRequest(request_t kind, unsigned long now);
+    void handleMsg(const MitsuProtocol::msg_t& msg, unsigned long now);
+    void storeRxSettings(MitsuProtocol::rxSettings_t settings, unsigned long now);
     
     // Internal states
-    typedef enum states_t {INFO_REQ, SETTINGS};
+    enum states_t {INFO_REQ, SETTINGS};
     states_t currentState = INFO_REQ;
     
-    MitsuProtocol::settings_t lastSettings = ml.emptySettings;
-    MitsuProtocol::settings_t targetSettings = ml.emptySettings;
-    MitsuProtocol::roomTemp_t lastRoomTemp = {0,false,0.0,false,0.0,false};
+    MitsuProtocol::settings_t lastSettings = MitsuProtocol::emptySettings;
+    MitsuProtocol::settings_t targetSettings = MitsuProtocol::emptySettings;
+    MitsuProtocol::roomTemp_t lastRoomTemp = {0.0,0.0,0,false,false,false};
     MitsuProtocol::info_t lastInfo = MitsuProtocol::roomTemp;
     
     unsigned long lastRxSettingsTime = 0;
@@ -82,12 +219,109 @@ class MitsuAc
     unsigned long lastTxSettingsTime = 0;    
     unsigned long lastTxInitTime = 0;
     unsigned long lastTxTime = 0;
+    unsigned long lastRxTime = 0;
+
+    // Requests waiting for their reply
+    struct inFlight_t {
+        bool active;
+        uint8_t retries;
+        unsigned long sentAt;
+        unsigned long deadline;
+        unsigned long roundTripTime;
+    };
+    inFlight_t inFlight[REQUEST_KINDS];
+
+    unsigned long generation = 0;
+    CHANGE_CB = NULL;
+    RX_CB = NULL;
+    void notifyChanges(uint16_t changes);
+    static void addToHistogram(uint32_t* histogram, unsigned long ms);
 
     bool firstRxSettingsReceived = false;
     bool targetSettingsAchieved = false;
+    bool settingsReadbackDue = false; // Settings acked, read them back next
+    bool roomTempReadbackDue = false; // Room temp asked for by the caller
+    bool settingsRefused = false;     // Settings nok'd, send them again next
+    int pendingCommands = 0;
+    unsigned long coalescedCommands = 0;
+    unsigned long commandTime = 0;
+    bool awaitingConfirm = false;
+
+    stats_t stats;
     
+    MitsuCapture* capture = NULL;
+
+    // Outgoing frames, waiting for the line
+    static const int TX_QUEUE_FRAMES = 4;
+    static const int TX_FRAME_SIZE = 32;
+    struct txFrame_t {
+        request_t request;
+        uint8_t len;
+        uint8_t data[TX_FRAME_SIZE];
+    };
+    txFrame_t txQueue[TX_QUEUE_FRAMES];
+    uint8_t txHead = 0;
+    uint8_t txCount = 0;
+    unsigned long lineIdleAt = 0;
+
+    bool queueFrame(const uint8_t* buf, int len, request_t request = reqNone);
+};
+
+/*
+MitsuAcT Class -
+The controller, over any Transport and with any timing and clock policy,
+all resolved at compile time. MitsuAc is the HardwareSerial one.
+*/
+template <typename Transport, typename Timing = MitsuTiming, typename Clock = MitsuClock>
+class MitsuAcT : public MitsuAcBase
+{
+  public:
+    // The clock policy, for code that times things alongside the controller
+    typedef Clock clock_t;
+
+    // Constructor
+    MitsuAcT(Transport *serial);
+       
+    // Start the serial and trigger an init packet to the unit
+    void initialize();
+    
+    // Monitor the unit, call this regularly in the main loop
+    void monitor();
+
+    // Whether the transport has bytes waiting for monitor()
+    bool rxAvailable();
+
+    // The Clock time by which monitor() next has something to do if no
+    // bytes arrive, for callers that sleep until the serial is readable
+    unsigned long getNextDeadline();
+
+    // Queue the requested settings, keys left out are unchanged. Commands
+    // put before the next free tx slot are merged into a single frame.
+    // Returns -1 and queues nothing if the json or any value is bad
+    int putSettingsJson(const char* jsonSettings);
+    // As putSettingsJson, with the valid fields of settings
+    void putSettings(const MitsuProtocol::settings_t& settings);
+
+    // Checksum and queue a hand built frame, for poking at the unit
+    void sendPkt(uint8_t data[], size_t len);
+
+  private:
+    // Private Methods
+	 void sendInit();
+    void sendRequestInfo(MitsuProtocol::info_t kind);
+    void sendSettings();
+    void sendRequest(request_t kind);
+    void checkRequestDeadlines();
+
     // Serial object and methods
-    void sendData(uint8_t* buf, int len);
-    HardwareSerial * _HardSerial;
+    void serviceTx();
+    bool lineIdle();
+    bool requestSlotFree();
+    bool txSlotFree();
+    Transport * _HardSerial;
 };
-//endif
+
+#include "MitsuAcImpl.h"
+
+typedef MitsuAcT<HardwareSerial> MitsuAc;
+#endif
@@ -0,0 +1,187 @@
+/*
+  MitsuAcGroup.h - Mitsubishi Air Conditioner/Heat Pump protocol library
+  Copyright (c) 2017 Jarrod Lamb.  All right reserved.
+  Originally reverse engineered by Hadley Rich (http://nice.net.nz)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef __MitsuAcGroup_H__
+#define __MitsuAcGroup_H__
+#include "MitsuAc.h"
+
+#if defined(ESP8266) || !defined(ARDUINO)
+#define GROUP_CHANGE_CB std::function<void(int unit)> groupChangeCb
+#else
+#define GROUP_CHANGE_CB void (*groupChangeCb)(int unit)
+#endif
+
+/*
+MitsuAcGroup Class -
+Drives up to MAX_UNITS controllers, each on its own serial (UARTs,
+SoftwareSerial...) from one monitor() call. A unit is only serviced when
+its transport has bytes or its next deadline has come, in rotating
+order so none is always last. Deadlines are asked of each unit every
+pass, so they follow its own Timing and anything put to it directly.
+Units can be of different MitsuAcT types, each reached through its own
+table of function pointers, but must share the group's Clock.
+*/
+template <int MAX_UNITS = 4, typename Clock = MitsuClock>
+class MitsuAcGroup
+{
+  public:
+    MitsuAcGroup() : count(0), next(0), generation(0), groupChangeCb(NULL) {
+    }
+
+    // Returns the unit's index, -1 if the group is full
+    template <typename Transport, typename Timing>
+    int add(MitsuAcT<Transport, Timing, Clock>* ac){
+        typedef MitsuAcT<Transport, Timing, Clock> ac_t;
+        if (count == MAX_UNITS){
+            return -1;
+        }
+        unit_t& u = units[count];
+        u.ac = ac;
+        u.initialize = &call<ac_t, &ac_t::initialize>;
+        u.monitor = &call<ac_t, &ac_t::monitor>;
+        u.rxAvailable = &rxAvailable<ac_t>;
+        u.nextDeadline = &nextDeadline<ac_t>;
+        u.putSettingsJson = &putSettingsJson<ac_t>;
+        u.generation = ac->getGeneration();
+        return count++;
+    }
+
+    // Start all the units
+    void initialize(){
+        for (int i = 0; i < count; i++){
+            units[i].initialize(units[i].ac);
+        }
+    }
+
+    // Service the units that have something to do, call this regularly
+    // in the main loop
+    void monitor(){
+        unsigned long now = Clock::now();
+        for (int n = 0; n < count; n++){
+            int i = (next + n) % count;
+            unit_t& u = units[i];
+            if (!u.rxAvailable(u.ac) && (long)(now - u.nextDeadline(u.ac)) < 0){
+                continue;
+            }
+            u.monitor(u.ac);
+            if (u.ac->getGeneration() != u.generation){
+                u.generation = u.ac->getGeneration();
+                generation++;
+                if (groupChangeCb){
+                    groupChangeCb(i);
+                }
+            }
+        }
+        next = count ? (next + 1) % count : 0;
+    }
+
+    // The earliest unit deadline, for sleeping between monitor() calls
+    // when nothing is arriving
+    unsigned long getNextDeadline(){
+        if (count == 0){
+            return Clock::now();
+        }
+        unsigned long earliest = units[0].nextDeadline(units[0].ac);
+        for (int i = 1; i < count; i++){
+            unsigned long deadline = units[i].nextDeadline(units[i].ac);
+            if ((long)(deadline - earliest) < 0){
+                earliest = deadline;
+            }
+        }
+        return earliest;
+    }
+
+    // As MitsuAcT::putSettingsJson for one unit, -1 for a bad unit too
+    int putSettingsJson(int unit, const char* jsonSettings){
+        if (unit < 0 || unit >= count){
+            return -1;
+        }
+        return units[unit].putSettingsJson(units[unit].ac, jsonSettings);
+    }
+
+    // Every unit's settings as one json array, in unit order. Returns the
+    // length written, 0 if it didn't fit in len bytes
+    size_t getStateJson(char* json, size_t len){
+        MitsuProtocol::jsonWriter w(json, len);
+        MitsuProtocol::settings_t settings;
+        MitsuProtocol::roomTemp_t roomTemp;
+        w.beginArray();
+        for (int i = 0; i < count; i++){
+            units[i].ac->getSettings(&settings, &roomTemp);
+            MitsuAcBase::settingsToJson(settings, roomTemp, w);
+        }
+        w.endArray();
+        return w.finish();
+    }
+
+    // Bumped whenever any unit's settings or room temperature change
+    unsigned long getGeneration(){
+        return generation;
+    }
+
+    // Called with the index of a unit whose state changed
+    void setChangeCb(GROUP_CHANGE_CB){
+        this->groupChangeCb = groupChangeCb;
+    }
+
+    int getCount(){
+        return count;
+    }
+
+    // For stats and the like
+    MitsuAcBase* getUnit(int unit){
+        return (unit >= 0 && unit < count) ? units[unit].ac : NULL;
+    }
+
+  private:
+    // Each unit's own MitsuAcT methods, behind plain function pointers
+    template <typename Ac, void (Ac::*method)()>
+    static void call(MitsuAcBase* ac){
+        (static_cast<Ac*>(ac)->*method)();
+    }
+    template <typename Ac>
+    static bool rxAvailable(MitsuAcBase* ac){
+        return static_cast<Ac*>(ac)->rxAvailable();
+    }
+    template <typename Ac>
+    static unsigned long nextDeadline(MitsuAcBase* ac){
+        return static_cast<Ac*>(ac)->getNextDeadline();
+    }
+    template <typename Ac>
+    static int putSettingsJson(MitsuAcBase* ac, const char* jsonSettings){
+        return static_cast<Ac*>(ac)->putSettingsJson(jsonSettings);
+    }
+
+    struct unit_t {
+        MitsuAcBase* ac;
+        void (*initialize)(MitsuAcBase* ac);
+        void (*monitor)(MitsuAcBase* ac);
+        bool (*rxAvailable)(MitsuAcBase* ac);
+        unsigned long (*nextDeadline)(MitsuAcBase* ac);
+        int (*putSettingsJson)(MitsuAcBase* ac, const char* jsonSettings);
+        unsigned long generation;
+    };
+
+    unit_t units[MAX_UNITS];
+    int count;
+    int next;
+    unsigned long generation;
+    GROUP_CHANGE_CB;
+};
+#endif
@@ -0,0 +1,334 @@
+/*
+  MitsuAcImpl.h - Mitsubishi Air Conditioner/Heat Pump protocol library
+  Copyright (c) 2017 Jarrod Lamb.  All right reserved.
+  Originally reverse engineered by Hadley Rich (http://nice.net.nz)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+// MitsuAcT member definitions, included at the end of MitsuAc.h
+#ifndef __MitsuAcImpl_H__
+#define __MitsuAcImpl_H__
+
+template <typename Transport, typename Timing, typename Clock>
+MitsuAcT<Transport, Timing, Clock>::MitsuAcT(Transport *serial) {
+  _HardSerial = serial;
+}
+
+template <typename Transport, typename Timing, typename Clock>
+void MitsuAcT<Transport, Timing, Clock>::sendPkt(uint8_t* data, size_t len){
+    uint8_t buf[64] =  {0};
+    memcpy(buf,data,len);
+    
+    // Put a checksum on the end
+    uint8_t sum = 0;
+    for (int i = 0; i < len; i++) {
+        sum += data[i];
+    }
+    buf[len] = (0xfc - sum) & 0xff;    
+
+    queueFrame (buf,len+1);
+    serviceTx();
+}
+
+template <typename Transport, typename Timing, typename Clock>
+void MitsuAcT<Transport, Timing, Clock>::initialize(){
+  MitsuTransportTraits<Transport>::begin(_HardSerial, BAUD);
+  MitsuTrace::setClock(&Clock::now);
+  // Let the unit settle before the first frame, without blocking
+  txHead = 0;
+  txCount = 0;
+  memset(inFlight, 0, sizeof(inFlight));
+  lineIdleAt = Clock::now() + Timing::SETTLE_TIME;
+  firstRxSettingsReceived = false;
+  settingsReadbackDue = false;
+  roomTempReadbackDue = false;
+  settingsRefused = false;
+  sendInit();
+}
+
+template <typename Transport, typename Timing, typename Clock>
+void MitsuAcT<Transport, Timing, Clock>::sendRequestInfo(MitsuProtocol::info_t kind){
+    request_t request = (kind == MitsuProtocol::settings) ? reqSettingsInfo : reqRoomTempInfo;
+    inFlight[request].retries = 0;
+    sendRequest(request);
+    lastTxInfoRequestTime = Clock::now();
+}
+
+template <typename Transport, typename Timing, typename Clock>
+void MitsuAcT<Transport, Timing, Clock>::sendSettings(){
+    inFlight[reqSettings].retries = 0;
+    settingsRefused = false;
+    sendRequest(reqSettings);
+    lastTxSettingsTime = Clock::now();
+}
+
+template <typename Transport, typename Timing, typename Clock>
+void MitsuAcT<Transport, Timing, Clock>::sendInit() {
+  stats.reinits++;
+  MITSU_TRACE_EVENT(MitsuTrace::reinit, NULL, 0);
+  inFlight[reqConnect].retries = 0;
+  sendRequest(reqConnect);
+  lastTxInitTime = Clock::now();
+}
+
+template <typename Transport, typename Timing, typename Clock>
+void MitsuAcT<Transport, Timing, Clock>::sendRequest(request_t kind){
+    uint8_t buf[TX_FRAME_SIZE] = {0};
+    int len = buildRequest(kind, buf);
+    if (len == 0){
+        // Nothing to say. Settings already there just need reading back
+        if (kind == reqSettings){
+            settingsReadbackDue = true;
+        }
+        return;
+    }
+    queueFrame(buf, len, kind);
+    serviceTx();
+}
+
+// Resend requests that missed their deadline, or give up on them
+template <typename Transport, typename Timing, typename Clock>
+void MitsuAcT<Transport, Timing, Clock>::checkRequestDeadlines(){
+    for (int i = 0; i < REQUEST_KINDS; i++){
+        inFlight_t& req = inFlight[i];
+        if (req.active && (long)(Clock::now() - req.deadline) >= 0){
+            uint8_t kind = static_cast<uint8_t>(i);
+            req.active = false;
+            if (req.retries < Timing::MAX_REQUEST_RETRIES){
+                MITSU_TRACE_EVENT(MitsuTrace::retry, &kind, 1);
+                req.retries++;
+                stats.requestRetries++;
+                sendRequest(static_cast<request_t>(i));
+            }else{
+                MITSU_TRACE_EVENT(MitsuTrace::timeout, &kind, 1);
+                stats.requestTimeouts++;
+            }
+        }
+    }
+}
+
+template <typename Transport, typename Timing, typename Clock>
+int MitsuAcT<Transport, Timing, Clock>::putSettingsJson(const char* jsonSettings){
+    return queueCommand(jsonSettings, Clock::now());
+}
+
+template <typename Transport, typename Timing, typename Clock>
+void MitsuAcT<Transport, Timing, Clock>::putSettings(const MitsuProtocol::settings_t& settings){
+    queueSettings(settings, Clock::now());
+}
+
+template <typename Transport, typename Timing, typename Clock>
+void MitsuAcT<Transport, Timing, Clock>::monitor() {
+  // Service the serial port, a chunk at a time
+  uint8_t chunk[RX_CHUNK_SIZE];
+  MitsuProtocol::msg_t msgs[RX_CHUNK_MSGS];
+  int available;
+  while ((available = _HardSerial->available()) > 0){
+    size_t len = _HardSerial->readBytes(chunk, available < RX_CHUNK_SIZE ? available : RX_CHUNK_SIZE);
+    if (len == 0){
+        break;
+    }
+    if (capture){
+        capture->record(MitsuCapture::rx, Clock::now(), chunk, len);
+    }
+    size_t offset = 0;
+    while (offset < len){
+        size_t consumed = 0;
+        size_t found = pb.addBytes(chunk + offset, len - offset, msgs, RX_CHUNK_MSGS, &consumed);
+        for (size_t i = 0; i < found; i++){
+            handleMsg(msgs[i], Clock::now());
+        }
+        offset += consumed;
+    }
+  }
+  
+  checkRequestDeadlines();
+  serviceTx();
+
+  switch (currentState){
+
+      case (INFO_REQ):
+         // If no infos are being received, trigger an init packet
+         if (((Clock::now() - lastRxSettingsTime) > (Timing::MIN_INFO_REQ_WAIT_TIME * 10)) && 
+             ((Clock::now() - lastRxRoomTempTime) > (Timing::MIN_INFO_REQ_WAIT_TIME * 10)) &&
+             ((Clock::now() - lastTxInitTime) > Timing::MIN_CONNECTION_WAIT_TIME) &&
+             txSlotFree()) {
+            firstRxSettingsReceived = false;
+            sendInit();
+         }
+         // Ask for the next info as soon as the last request is answered,
+         // or has been retried and given up on. Acked settings are read
+         // back first, refused ones are resent first
+         else if ((pendingCommands == 0) && !settingsRefused && requestSlotFree()){
+             MitsuProtocol::info_t thisInfo = lastInfo==MitsuProtocol::settings ? MitsuProtocol::roomTemp : MitsuProtocol::settings;
+             if (settingsReadbackDue){
+                 thisInfo = MitsuProtocol::settings;
+                 settingsReadbackDue = false;
+             }else if (roomTempReadbackDue){
+                 thisInfo = MitsuProtocol::roomTemp;
+                 roomTempReadbackDue = false;
+             }
+             sendRequestInfo(thisInfo);
+             lastInfo = thisInfo;
+         }   
+         currentState = SETTINGS;
+         break;
+      
+      case (SETTINGS):
+      
+         // Send queued commands at the first free slot
+         if ((pendingCommands > 0) && requestSlotFree()){
+             sendSettings();
+             coalescedCommands += pendingCommands - 1;
+             pendingCommands = 0;
+         }
+         // Resend refused settings at the next free slot, a few times,
+         // before leaving it to the retransmit below
+         else if (settingsRefused && requestSlotFree()){
+             settingsRefused = false;
+             inFlight_t& req = inFlight[reqSettings];
+             if (req.retries < Timing::MAX_REQUEST_RETRIES){
+                 uint8_t kind = reqSettings;
+                 MITSU_TRACE_EVENT(MitsuTrace::retry, &kind, 1);
+                 req.retries++;
+                 stats.requestRetries++;
+                 sendRequest(reqSettings);
+                 lastTxSettingsTime = Clock::now();
+             }
+         }
+         // Check the target settings against the latest settings
+         else if (firstRxSettingsReceived &&
+             !targetSettingsAchieved &&
+             (!ml.equals(targetSettings, lastSettings)) && 
+             ((Clock::now() - lastTxSettingsTime) > Timing::MIN_SETTINGS_WAIT_TIME) &&
+             requestSlotFree()){
+             stats.settingsRetransmits++;
+             MITSU_TRACE_EVENT(MitsuTrace::retransmit, NULL, 0);
+             sendSettings();
+         }
+         currentState = INFO_REQ;
+         break;
+    }
+}
+
+template <typename Transport, typename Timing, typename Clock>
+void MitsuAcT<Transport, Timing, Clock>::serviceTx(){
+    while (txCount > 0 && (long)(Clock::now() - lineIdleAt) >= 0){
+        txFrame_t& frame = txQueue[txHead];
+        if (!_HardSerial || MitsuTransportTraits<Transport>::txRoom(_HardSerial) < frame.len){
+            return; // Would block, try again next time round
+        }
+        _HardSerial->write(frame.data, frame.len);
+        MITSU_TRACE_PACKET(MitsuTrace::txFrame, frame.data, frame.len);
+        stats.bytesTx += frame.len;
+        stats.framesTx++;
+
+        // The frame is on the wire until its last stop bit
+        lastTxTime = Clock::now();
+        lineIdleAt = lastTxTime + (frame.len * BITS_PER_BYTE * 1000UL + BAUD - 1) / BAUD;
+        if (capture){
+            capture->record(MitsuCapture::tx, lastTxTime, frame.data, frame.len);
+        }
+        if (frame.request != reqNone){
+            inFlight_t& req = inFlight[frame.request];
+            req.active = true;
+            req.sentAt = lastTxTime;
+            req.deadline = lineIdleAt + Timing::REQUEST_TIMEOUT;
+        }
+
+        txHead = (txHead + 1) % TX_QUEUE_FRAMES;
+        txCount--;
+    }
+}
+
+template <typename Transport, typename Timing, typename Clock>
+bool MitsuAcT<Transport, Timing, Clock>::rxAvailable(){
+    return _HardSerial && _HardSerial->available() > 0;
+}
+
+template <typename Transport, typename Timing, typename Clock>
+unsigned long MitsuAcT<Transport, Timing, Clock>::getNextDeadline(){
+    unsigned long now = Clock::now();
+    unsigned long next = now + Timing::MIN_INFO_REQ_WAIT_TIME;
+    bool waiting = false;
+    auto earliest = [&next](unsigned long t){
+        if ((long)(t - next) < 0){
+            next = t;
+        }
+    };
+    auto latest = [](unsigned long a, unsigned long b){
+        return ((long)(a - b) > 0) ? a : b;
+    };
+
+    // The queue drains as the line frees
+    if (txCount > 0){
+        earliest(lineIdleAt);
+    }
+    // Replies that don't come
+    for (int i = 0; i < REQUEST_KINDS; i++){
+        if (inFlight[i].active){
+            earliest(inFlight[i].deadline);
+            waiting = true;
+        }
+    }
+    // The next request goes as soon as the slot frees up, the state
+    // machine takes a pass to get round to it
+    if (!waiting && txCount == 0){
+        earliest(latest(lastRxTime + Timing::MIN_RESPONSE_GAP_TIME, lineIdleAt));
+    }
+    // Timers still to run out, once they have the above decide. The
+    // settings retransmit, and re-init once the unit has gone quiet
+    auto timer = [&](unsigned long t){
+        if ((long)(t - now) > 0){
+            earliest(t);
+        }
+    };
+    if (firstRxSettingsReceived && !targetSettingsAchieved){
+        timer(lastTxSettingsTime + Timing::MIN_SETTINGS_WAIT_TIME + 1);
+    }
+    timer(latest(latest(lastRxSettingsTime, lastRxRoomTempTime) + Timing::MIN_INFO_REQ_WAIT_TIME * 10,
+                 latest(lastTxInitTime + Timing::MIN_CONNECTION_WAIT_TIME,
+                        lastTxTime + Timing::MIN_TX_DELAY_WAIT_TIME)) + 1);
+
+    return ((long)(next - now) < 0) ? now : next;
+}
+
+// Nothing queued or on the wire
+template <typename Transport, typename Timing, typename Clock>
+bool MitsuAcT<Transport, Timing, Clock>::lineIdle(){
+    return (txCount == 0) && ((long)(Clock::now() - lineIdleAt) >= 0);
+}
+
+// The line is idle, nothing is waiting for a reply and the guard gap
+// after the last reply has passed
+template <typename Transport, typename Timing, typename Clock>
+bool MitsuAcT<Transport, Timing, Clock>::requestSlotFree(){
+    if (!lineIdle() || ((Clock::now() - lastRxTime) < Timing::MIN_RESPONSE_GAP_TIME)){
+        return false;
+    }
+    for (int i = 0; i < REQUEST_KINDS; i++){
+        if (inFlight[i].active){
+            return false;
+        }
+    }
+    return true;
+}
+
+// Nothing queued and the last frame went out long enough ago
+template <typename Transport, typename Timing, typename Clock>
+bool MitsuAcT<Transport, Timing, Clock>::txSlotFree(){
+    return (txCount == 0) && ((Clock::now() - lastTxTime) > Timing::MIN_TX_DELAY_WAIT_TIME);
+}
+#endif
@@ -0,0 +1,117 @@
+/*
+  MitsuCapture.cpp - Mitsubishi Air Conditioner/Heat Pump protocol library
+  Copyright (c) 2017 Jarrod Lamb.  All right reserved.
+  Originally reverse engineered by Hadley Rich (http://nice.net.nz)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <string.h>
+#include "MitsuCapture.h"
+
+static const uint8_t FILE_MAGIC[4] = {'M', 'T', 'S', 'C'};
+
+MitsuCapture::MitsuCapture(record_t* ring, size_t capacity) {
+    this->ring = ring;
+    this->capacity = capacity;
+    clear();
+}
+
+void MitsuCapture::record(dir_t dir, uint32_t timeMs, const uint8_t* data, size_t len){
+    if (capacity == 0){
+        return;
+    }
+    while (len > 0){
+        size_t n = (len > MAX_DATA_LEN) ? MAX_DATA_LEN : len;
+        record_t& rec = ring[head];
+        rec.timeMs = timeMs;
+        rec.dir = static_cast<uint8_t>(dir);
+        rec.len = static_cast<uint8_t>(n);
+        memcpy(rec.data, data, n);
+
+        head = (head + 1) % capacity;
+        if (used < capacity){
+            used++;
+        }else{
+            droppedRecords++; // Overwrote the oldest
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+bool MitsuCapture::pop(record_t* rec){
+    if (used == 0){
+        return false;
+    }
+    size_t tail = (head + capacity - used) % capacity;
+    *rec = ring[tail];
+    used--;
+    return true;
+}
+
+size_t MitsuCapture::available(){
+    return used;
+}
+
+unsigned long MitsuCapture::dropped(){
+    return droppedRecords;
+}
+
+void MitsuCapture::clear(){
+    head = 0;
+    used = 0;
+    droppedRecords = 0;
+}
+
+size_t MitsuCapture::writeFileHeader(uint8_t* out){
+    memcpy(out, FILE_MAGIC, sizeof(FILE_MAGIC));
+    out[4] = VERSION;
+    out[5] = 0;
+    out[6] = 0;
+    out[7] = 0;
+    return FILE_HEADER_LEN;
+}
+
+bool MitsuCapture::checkFileHeader(const uint8_t* in, size_t len){
+    return (len >= FILE_HEADER_LEN &&
+            memcmp(in, FILE_MAGIC, sizeof(FILE_MAGIC)) == 0 &&
+            in[4] == VERSION);
+}
+
+size_t MitsuCapture::encode(const record_t& rec, uint8_t* out){
+    out[0] = rec.timeMs & 0xff;
+    out[1] = (rec.timeMs >> 8) & 0xff;
+    out[2] = (rec.timeMs >> 16) & 0xff;
+    out[3] = (rec.timeMs >> 24) & 0xff;
+    out[4] = rec.dir;
+    out[5] = rec.len;
+    memcpy(out + RECORD_HEADER_LEN, rec.data, rec.len);
+    return RECORD_HEADER_LEN + rec.len;
+}
+
+size_t MitsuCapture::decode(const uint8_t* in, size_t len, record_t* rec){
+    if (len < RECORD_HEADER_LEN){
+        return 0;
+    }
+    uint8_t dataLen = in[5];
+    if (dataLen > MAX_DATA_LEN || len < (size_t)(RECORD_HEADER_LEN + dataLen)){
+        return 0;
+    }
+    rec->timeMs = (uint32_t)in[0] | ((uint32_t)in[1] << 8) | ((uint32_t)in[2] << 16) | ((uint32_t)in[3] << 24);
+    rec->dir = in[4];
+    rec->len = dataLen;
+    memcpy(rec->data, in + RECORD_HEADER_LEN, dataLen);
+    return RECORD_HEADER_LEN + dataLen;
+}
@@ -0,0 +1,84 @@
+/*
+  MitsuCapture.h - Mitsubishi Air Conditioner/Heat Pump protocol library
+  Copyright (c) 2017 Jarrod Lamb.  All right reserved.
+  Originally reverse engineered by Hadley Rich (http://nice.net.nz)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef __MitsuCapture_H__
+#define __MitsuCapture_H__
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+MitsuCapture Class -
+Binary capture of the serial traffic. RX bytes are recorded as read
+from the UART (so line noise is kept), TX as whole frames, each with
+a millisecond timestamp. Records go into a caller supplied ring which
+overwrites the oldest record when full; pop() them out and encode()
+them to store or send elsewhere.
+
+Encoded form, all integers little endian:
+  file header: 'M' 'T' 'S' 'C' version(1) 0 0 0
+  record:      timeMs(4) dir(1) len(1) data(len)
+*/
+class MitsuCapture
+{
+public:
+    enum dir_t {
+        rx = 0x01,
+        tx = 0x02
+    };
+
+    static const int MAX_DATA_LEN      = 32;
+    static const int FILE_HEADER_LEN   = 8;
+    static const int RECORD_HEADER_LEN = 6;
+    static const int MAX_RECORD_LEN    = RECORD_HEADER_LEN + MAX_DATA_LEN;
+    static const uint8_t VERSION       = 1;
+
+    struct record_t {
+        uint32_t timeMs;
+        uint8_t dir;
+        uint8_t len;
+        uint8_t data[MAX_DATA_LEN];
+    };
+
+    // Constructor, ring must hold capacity records
+    MitsuCapture(record_t* ring, size_t capacity);
+
+    // Record bytes, longer runs are split over several records
+    void record(dir_t dir, uint32_t timeMs, const uint8_t* data, size_t len);
+
+    // Take the oldest record, false if there are none
+    bool pop(record_t* rec);
+    size_t available();
+    unsigned long dropped();
+    void clear();
+
+    // Encoding
+    static size_t writeFileHeader(uint8_t* out);
+    static bool checkFileHeader(const uint8_t* in, size_t len);
+    static size_t encode(const record_t& rec, uint8_t* out);
+    // Returns the bytes used, 0 if in doesn't hold a whole record
+    static size_t decode(const uint8_t* in, size_t len, record_t* rec);
+
+private:
+    record_t* ring;
+    size_t capacity;
+    size_t head;  // next record written
+    size_t used;
+    unsigned long droppedRecords;
+};
+#endif
@@ -21,26 +21,24 @@
 #include <stdlib_noniso.h>
 #include "MitsuProtocol.h"
 
-#ifdef DEBUG_ON
-void MitsuProtocol::log (const char* msg){
-    if (debugCb){
-        debugCb (msg);
-    }
+MitsuProtocol::MitsuProtocol() {
 }
-void MitsuProtocol::setDebugCb(DEBUG_CB){
-    this->debugCb = debugCb;
+
+constexpr MitsuProtocol::settings_t MitsuProtocol::emptySettings;
+
+int MitsuProtocol::getTxSettingsPacket (uint8_t* buffer, const settings_t& settings){
+    return settingsPacket(buffer, settings, settings.valid & ALL_SETTINGS);
 }
-#endif
-/* END DEBUG */
 
-MitsuProtocol::MitsuProtocol() {
+int MitsuProtocol::getTxSettingsPacket (uint8_t* buffer, const settings_t& settings, const settings_t& current){
+    uint8_t control = controlFor(settings, current) & ALL_SETTINGS;
+    if (!control){
+        return 0;
+    }
+    return settingsPacket(buffer, settings, control);
 }
 
-int MitsuProtocol::getTxSettingsPacket (uint8_t* buffer, settings_t settings){
-    #ifdef DEBUG_CALLS
-    log("MitsuProtocol::getTxSettingsPacket");
-    #endif    
-    
+int MitsuProtocol::settingsPacket (uint8_t* buffer, const settings_t& settings, uint8_t control){
     // Zeroize the packet
     for (int i = 0; i < DATA_PACKET_LEN; i++){
         buffer[i] = 0;
@@ -53,29 +51,24 @@ int MitsuProtocol::getTxSettingsPacket (uint8_t* buffer, settings_t settings){
     buffer[LENGTH_POS]        = DATA_PACKET_LEN - CHECKSUM_LEN - HEADER_LEN;
     buffer[DATA_KIND_POS]     = static_cast<uint8_t>(dataKind_t::settingsRequest);
 
-    if (settings.powerValid){
+    buffer[DATA_CONTROL] = control;
+    if (control & control_t::power){
         buffer[DATA_POWER_POS] = static_cast<uint8_t>(settings.power);
-        buffer[DATA_CONTROL] += static_cast<uint8_t>(control_t::power);
     }
-    if (settings.modeValid){
+    if (control & control_t::mode){
         buffer[DATA_MODE_POS] = static_cast<uint8_t>(settings.mode);
-        buffer[DATA_CONTROL] += static_cast<uint8_t>(control_t::mode);
     }
-    if (settings.tempDegCValid){
+    if (control & control_t::temp){
         buffer[DATA_TEMP_POS] = tempToByte(settings.tempDegC);
-        buffer[DATA_CONTROL] += static_cast<uint8_t>(control_t::temp);
     }
-    if (settings.fanValid){
+    if (control & control_t::fan){
         buffer[DATA_FAN_POS] = static_cast<uint8_t>(settings.fan);
-        buffer[DATA_CONTROL] += static_cast<uint8_t>(control_t::fan);
     }
-    if (settings.vaneValid){
+    if (control & control_t::vane){
         buffer[DATA_VANE_POS] = static_cast<uint8_t>(settings.vane);
-        buffer[DATA_CONTROL] += static_cast<uint8_t>(control_t::vane);
     }
-    if (settings.wideVaneValid){
+    if (control & control_t::wideVane){
         buffer[DATA_WIDEVANE_POS] = static_cast<uint8_t>(settings.wideVane);
-        buffer[DATA_CONTROL] += static_cast<uint8_t>(control_t::wideVane);
     }
 
     // Checksum
@@ -85,10 +78,6 @@ int MitsuProtocol::getTxSettingsPacket (uint8_t* buffer, settings_t settings){
 }
 
 int MitsuProtocol::getTxConnectPacket (uint8_t* buffer){
-    #ifdef DEBUG_CALLS
-    log("MitsuProtocol::getTxConnectPacket");
-    #endif    
-    
     // Zeroize the packet
     for (int i = 0; i < CONNECT_PACKET_LEN; i++){
         buffer[i] = 0;
@@ -110,10 +99,6 @@ int MitsuProtocol::getTxConnectPacket (uint8_t* buffer){
 
 
 int MitsuProtocol::getTxInfoPacket (uint8_t* buffer, info_t kind){
-    #ifdef DEBUG_CALLS
-    log("MitsuProtocol::getTxInfoPacket");
-    #endif    
-    
     // Zeroize the packet
     for (int i = 0; i < INFO_PACKET_LEN; i++){
         buffer[i] = 0;
@@ -132,7 +117,7 @@ int MitsuProtocol::getTxInfoPacket (uint8_t* buffer, info_t kind){
 }
 
 
-uint8_t MitsuProtocol::calculateChecksum(uint8_t* data, int len) {
+uint8_t MitsuProtocol::calculateChecksum(const uint8_t* data, int len) {
     uint8_t sum = 0;
     for (int i = 0; i < len; i++) {
         sum += data[i];
@@ -140,194 +125,534 @@ uint8_t MitsuProtocol::calculateChecksum(uint8_t* data, int len) {
     return (0xfc - sum) & 0xff;
 }
 
-const char* MitsuProtocol::power_tToString (power_t power){
-    switch (power){
-        case power_t::powerOn:return "on";
-        case power_t::powerOff:return "off";
+/* String conversions */
+
+#define ENUM_NAME(value, name) {static_cast<uint8_t>(value), sizeof(name) - 1, name}
+
+// fromString() goes straight to the one name that can match: each table
+// has an index by nameSlot() of its length and first character, built
+// here and checked to have no two names in a slot
+static constexpr uint8_t NO_NAME = 0xff;
+
+static constexpr uint8_t nameSlot(size_t len, char first){
+    return static_cast<uint8_t>((len * 10 + static_cast<uint8_t>(first)) & (MitsuProtocol::ENUM_SLOTS - 1));
+}
+
+static constexpr uint8_t slotName(const MitsuProtocol::enumName_t* names, size_t count, uint8_t slot, size_t i = 0){
+    return (i == count) ? NO_NAME :
+           (nameSlot(names[i].len, names[i].name[0]) == slot) ? static_cast<uint8_t>(i) :
+           slotName(names, count, slot, i + 1);
+}
+
+static constexpr bool slotsUnique(const MitsuProtocol::enumName_t* names, size_t count, size_t i = 0){
+    return i == count ||
+           (slotName(names, count, nameSlot(names[i].len, names[i].name[0])) == i && slotsUnique(names, count, i + 1));
+}
+
+#define ENUM_COUNT(names) (sizeof(names) / sizeof(names[0]))
+#define ENUM_SLOT(names, s) slotName(names, ENUM_COUNT(names), s)
+#define ENUM_TABLE(table, names) \
+    static_assert(slotsUnique(names, ENUM_COUNT(names)), #names " has two names in one slot, change nameSlot()"); \
+    static constexpr uint8_t names##Slots[MitsuProtocol::ENUM_SLOTS] = { \
+        ENUM_SLOT(names, 0),  ENUM_SLOT(names, 1),  ENUM_SLOT(names, 2),  ENUM_SLOT(names, 3), \
+        ENUM_SLOT(names, 4),  ENUM_SLOT(names, 5),  ENUM_SLOT(names, 6),  ENUM_SLOT(names, 7), \
+        ENUM_SLOT(names, 8),  ENUM_SLOT(names, 9),  ENUM_SLOT(names, 10), ENUM_SLOT(names, 11), \
+        ENUM_SLOT(names, 12), ENUM_SLOT(names, 13), ENUM_SLOT(names, 14), ENUM_SLOT(names, 15)}; \
+    const MitsuProtocol::enumTable_t MitsuProtocol::table = {names, ENUM_COUNT(names), names##Slots}
+
+static constexpr MitsuProtocol::enumName_t powerNames[] = {
+    ENUM_NAME(MitsuProtocol::power_t::powerOn,  "on"),
+    ENUM_NAME(MitsuProtocol::power_t::powerOff, "off")
+};
+static constexpr MitsuProtocol::enumName_t modeNames[] = {
+    ENUM_NAME(MitsuProtocol::mode_t::modeHeat, "heat"),
+    ENUM_NAME(MitsuProtocol::mode_t::modeDry,  "dry"),
+    ENUM_NAME(MitsuProtocol::mode_t::modeFan,  "fan"),
+    ENUM_NAME(MitsuProtocol::mode_t::modeCool, "cool"),
+    ENUM_NAME(MitsuProtocol::mode_t::modeAuto, "auto")
+};
+static constexpr MitsuProtocol::enumName_t fanNames[] = {
+    ENUM_NAME(MitsuProtocol::fan_t::fanAuto,  "auto"),
+    ENUM_NAME(MitsuProtocol::fan_t::fanQuiet, "quiet"),
+    ENUM_NAME(MitsuProtocol::fan_t::fan1,     "1"),
+    ENUM_NAME(MitsuProtocol::fan_t::fan2,     "2"),
+    ENUM_NAME(MitsuProtocol::fan_t::fan3,     "3"),
+    ENUM_NAME(MitsuProtocol::fan_t::fan4,     "4")
+};
+static constexpr MitsuProtocol::enumName_t vaneNames[] = {
+    ENUM_NAME(MitsuProtocol::vane_t::vaneAuto,  "auto"),
+    ENUM_NAME(MitsuProtocol::vane_t::vane1,     "1"),
+    ENUM_NAME(MitsuProtocol::vane_t::vane2,     "2"),
+    ENUM_NAME(MitsuProtocol::vane_t::vane3,     "3"),
+    ENUM_NAME(MitsuProtocol::vane_t::vane4,     "4"),
+    ENUM_NAME(MitsuProtocol::vane_t::vane5,     "5"),
+    ENUM_NAME(MitsuProtocol::vane_t::vaneSwing, "swing")
+};
+static constexpr MitsuProtocol::enumName_t wideVaneNames[] = {
+    ENUM_NAME(MitsuProtocol::wideVane_t::wideVaneFullLeft,     "full_left"),
+    ENUM_NAME(MitsuProtocol::wideVane_t::wideVaneHalfLeft,     "half_left"),
+    ENUM_NAME(MitsuProtocol::wideVane_t::wideVaneCenter,       "center"),
+    ENUM_NAME(MitsuProtocol::wideVane_t::wideVaneHalfRight,    "half_right"),
+    ENUM_NAME(MitsuProtocol::wideVane_t::wideVaneFullRight,    "full_right"),
+    ENUM_NAME(MitsuProtocol::wideVane_t::wideVaneLeftAndRight, "left_and_right"),
+    ENUM_NAME(MitsuProtocol::wideVane_t::wideVaneSwing,        "swing")
+};
+
+ENUM_TABLE(powerTable,    powerNames);
+ENUM_TABLE(modeTable,     modeNames);
+ENUM_TABLE(fanTable,      fanNames);
+ENUM_TABLE(vaneTable,     vaneNames);
+ENUM_TABLE(wideVaneTable, wideVaneNames);
+
+const char* MitsuProtocol::toString (const enumTable_t& table, uint8_t value){
+    for (uint8_t i = 0; i < table.count; i++){
+        if (table.names[i].value == value){
+            return table.names[i].name;
+        }
     }
     return "undefined";
 }
-void MitsuProtocol::power_tFromString (const char* powerStr, power_t* power, bool success){
-    success=true;
-    if (strcmp(powerStr,"on")==0){*power=power_t::powerOn;}
-    else if(strcmp(powerStr,"off")==0){*power=power_t::powerOff;}
-    else{*power=power_t::powerOff;success=false;}
+
+// The only name str can be is the one in its slot, if any
+bool MitsuProtocol::fromString (const enumTable_t& table, const char* str, size_t len, uint8_t* value){
+    if (len == 0){
+        return false;
+    }
+    uint8_t i = table.slots[nameSlot(len, str[0])];
+    if (i == NO_NAME){
+        return false;
+    }
+    const enumName_t& entry = table.names[i];
+    if (entry.len != len || memcmp(entry.name, str, len) != 0){
+        return false;
+    }
+    *value = entry.value;
+    return true;
+}
+
+const char* MitsuProtocol::power_tToString (power_t power){
+    return toString(powerTable, static_cast<uint8_t>(power));
+}
+void MitsuProtocol::power_tFromString (const char* powerStr, power_t* power, bool& success){
+    uint8_t value = static_cast<uint8_t>(power_t::powerOff);
+    success = fromString(powerTable, powerStr, strlen(powerStr), &value);
+    *power = static_cast<power_t>(value);
 }
 
 const char* MitsuProtocol::mode_tToString (mode_t mode){
-    switch (mode){
-        case mode_t::modeHeat:return "heat";
-        case mode_t::modeDry:return "dry";
-        case mode_t::modeFan:return "fan";
-        case mode_t::modeCool:return "cool";
-        case mode_t::modeAuto:return "auto";
-    }
-    return "undefined";
+    return toString(modeTable, static_cast<uint8_t>(mode));
 }
-void MitsuProtocol::mode_tFromString (const char* modeStr, mode_t* mode, bool success){
-    success=true;
-    if(strcmp(modeStr,"heat")==0){ *mode=mode_t::modeHeat;}
-    else if(strcmp(modeStr,"dry")==0){ *mode=mode_t::modeDry;}
-    else if(strcmp(modeStr,"fan")==0){ *mode=mode_t::modeFan;}
-    else if(strcmp(modeStr,"cool")==0){ *mode=mode_t::modeCool;}
-    else if(strcmp(modeStr,"auto")==0){ *mode=mode_t::modeAuto;}
-    else{*mode=mode_t::modeFan;success=false;}
+void MitsuProtocol::mode_tFromString (const char* modeStr, mode_t* mode, bool& success){
+    uint8_t value = static_cast<uint8_t>(mode_t::modeFan);
+    success = fromString(modeTable, modeStr, strlen(modeStr), &value);
+    *mode = static_cast<mode_t>(value);
 }
 
 const char* MitsuProtocol::fan_tToString (fan_t fan){
-    switch (fan){
-        case fan_t::fanAuto:return "auto";
-        case fan_t::fanQuiet:return "quiet";
-        case fan_t::fan1:return "1";
-        case fan_t::fan2:return "2";
-        case fan_t::fan3:return "3";
-        case fan_t::fan4:return "4";
+    return toString(fanTable, static_cast<uint8_t>(fan));
+}
+void MitsuProtocol::fan_tFromString (const char* fanStr, fan_t* fan, bool& success){
+    uint8_t value = static_cast<uint8_t>(fan_t::fan1);
+    success = fromString(fanTable, fanStr, strlen(fanStr), &value);
+    *fan = static_cast<fan_t>(value);
+}
+
+const char* MitsuProtocol::vane_tToString (vane_t vane){
+    return toString(vaneTable, static_cast<uint8_t>(vane));
+}
+void MitsuProtocol::vane_tFromString (const char* vaneStr, vane_t* vane, bool& success){
+    uint8_t value = static_cast<uint8_t>(vane_t::vane3);
+    success = fromString(vaneTable, vaneStr, strlen(vaneStr), &value);
+    *vane = static_cast<vane_t>(value);
+}
+
+const char* MitsuProtocol::wideVane_tToString (wideVane_t wideVane){
+    return toString(wideVaneTable, static_cast<uint8_t>(wideVane));
+}
+void MitsuProtocol::wideVane_tFromString (const char* wideVaneStr, wideVane_t* wideVane, bool& success){
+    uint8_t value = static_cast<uint8_t>(wideVane_t::wideVaneCenter);
+    success = fromString(wideVaneTable, wideVaneStr, strlen(wideVaneStr), &value);
+    *wideVane = static_cast<wideVane_t>(value);
+}
+
+/* Message kinds */
+
+static const MitsuProtocol::msgKind_t msgKinds[MitsuProtocol::MSG_KIND_COUNT - 1] = {
+    MitsuProtocol::txConnect,
+    MitsuProtocol::txSettings,
+    MitsuProtocol::txInfoRequest,
+    MitsuProtocol::rxCurrentSettings,
+    MitsuProtocol::rxStatusOk,
+    MitsuProtocol::rxStatusNok
+};
+
+static const char* const msgKindNames[MitsuProtocol::MSG_KIND_COUNT] = {
+    "txConnect",
+    "txSettings",
+    "txInfoRequest",
+    "rxCurrentSettings",
+    "rxStatusOk",
+    "rxStatusNok",
+    "unknown"
+};
+
+int MitsuProtocol::msgKindIndex (uint8_t kind){
+    for (int i = 0; i < MSG_KIND_COUNT - 1; i++){
+        if (msgKinds[i] == kind){
+            return i;
+        }
     }
-    return "undefined";
+    return MSG_KIND_COUNT - 1;
 }
-void MitsuProtocol::fan_tFromString (const char* fanStr, fan_t* fan, bool success){
-    success=true;
 
-    if(strcmp(fanStr,"auto")==0){ *fan= fan_t::fanAuto;}
-    else if(strcmp(fanStr,"quiet")==0){ *fan= fan_t::fanQuiet;}
-    else if(strcmp(fanStr,"1")==0){ *fan= fan_t::fan1;}
-    else if(strcmp(fanStr,"2")==0){ *fan= fan_t::fan2;}
-    else if(strcmp(fanStr,"3")==0){ *fan=  fan_t::fan3;}
-    else if(strcmp(fanStr,"4")==0){*fan= fan_t::fan4;}
-    else{*fan=fan_t::fan1;success=false;}
+const char* MitsuProtocol::msgKindName (int index){
+    return (index >= 0 && index < MSG_KIND_COUNT) ? msgKindNames[index] : msgKindNames[MSG_KIND_COUNT - 1];
+}
 
+/* Json commands */
+
+struct jsonKey_t {
+    const char* name;
+    uint8_t len;
+    uint8_t control;
+    const MitsuProtocol::enumTable_t* table; // NULL for integers
+};
+
+static const jsonKey_t jsonKeys[] = {
+    {"pwr",    3, MitsuProtocol::control_t::power,    &MitsuProtocol::powerTable},
+    {"mode",   4, MitsuProtocol::control_t::mode,     &MitsuProtocol::modeTable},
+    {"fan",    3, MitsuProtocol::control_t::fan,      &MitsuProtocol::fanTable},
+    {"vane",   4, MitsuProtocol::control_t::vane,     &MitsuProtocol::vaneTable},
+    {"wdvane", 6, MitsuProtocol::control_t::wideVane, &MitsuProtocol::wideVaneTable},
+    {"stemp",  5, MitsuProtocol::control_t::temp,     NULL}
+};
+
+static void skipSpace(const char*& p){
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'){
+        p++;
+    }
 }
 
-const char* MitsuProtocol::vane_tToString (vane_t vane){
+// A quoted string, str/len point at its contents inside the json
+static bool scanString(const char*& p, const char** str, size_t* len, bool* escaped){
+    if (*p != '"'){
+        return false;
+    }
+    *str = ++p;
+    *escaped = false;
+    while (*p != '"'){
+        if (*p == '\0'){
+            return false;
+        }
+        if (*p == '\\'){
+            *escaped = true;
+            if (*++p == '\0'){
+                return false;
+            }
+        }
+        p++;
+    }
+    *len = p - *str;
+    p++;
+    return true;
+}
 
-    switch (vane){
-        case vane_t::vaneAuto:return "auto";
-        case vane_t::vane1:return "1";
-        case vane_t::vane2:return "2";
-        case vane_t::vane3:return "3";
-        case vane_t::vane4:return "4";
-        case vane_t::vane5:return "5";
-        case vane_t::vaneSwing:return "swing";
+// A number, true, false or null
+static bool scanScalar(const char*& p, const char** str, size_t* len){
+    *str = p;
+    while ((*p >= '0' && *p <= '9') || (*p >= 'a' && *p <= 'z') ||
+           *p == '-' || *p == '+' || *p == '.' || *p == 'E'){
+        p++;
     }
-    return "undefined";
+    *len = p - *str;
+    return *len > 0;
 }
 
-void MitsuProtocol::vane_tFromString (const char* vaneStr, vane_t* vane, bool success){
-    success=true;
-        if(strcmp(vaneStr,"auto")==0){*vane= vane_t::vaneAuto;}
-        else if(strcmp(vaneStr,"1")==0){*vane= vane_t::vane1;}
-        else if(strcmp(vaneStr,"2")==0){*vane= vane_t::vane2;}
-        else if(strcmp(vaneStr,"3")==0){*vane= vane_t::vane3;}
-        else if(strcmp(vaneStr,"4")==0){*vane= vane_t::vane4;}
-        else if(strcmp(vaneStr,"5")==0){*vane= vane_t::vane5;}
-        else if(strcmp(vaneStr,"swing")==0){*vane= vane_t::vaneSwing;}
-        else{*vane=vane_t::vane3;success=false;}
+// An object or array, for keys the library doesn't know. Strings in it
+// are stepped over whole, nesting deeper than this fails the parse
+static const int MAX_JSON_DEPTH = 8;
+
+static bool scanNested(const char*& p, const char** str, size_t* len){
+    const char* s;
+    size_t sLen;
+    bool escaped;
+    int depth = 0;
+    *str = p;
+    do {
+        if (*p == '"'){
+            if (!scanString(p, &s, &sLen, &escaped)){
+                return false;
+            }
+            continue;
+        }
+        if (*p == '{' || *p == '['){
+            if (++depth > MAX_JSON_DEPTH){
+                return false;
+            }
+        }else if (*p == '}' || *p == ']'){
+            depth--;
+        }else if (*p == '\0'){
+            return false;
+        }
+        p++;
+    } while (depth > 0);
+    *len = p - *str;
+    return true;
 }
 
-const char* MitsuProtocol::wideVane_tToString (wideVane_t wideVane){
-    switch (wideVane){
-        case wideVane_t::wideVaneFullLeft:return "full_left";
-        case wideVane_t::wideVaneHalfLeft:return "half_left";
-        case wideVane_t::wideVaneCenter:return "center";
-        case wideVane_t::wideVaneHalfRight:return "half_right";
-        case wideVane_t::wideVaneFullRight:return "full_right";
-        case wideVane_t::wideVaneLeftAndRight:return "left_and_right";
-        case wideVane_t::wideVaneSwing:return "swing";
+static bool parseInt(const char* str, size_t len, int* value){
+    size_t i = 0;
+    bool negative = (len > 0 && str[0] == '-');
+    if (negative){
+        i++;
     }
-    return "undefined";
+    if (i == len || len - i > 4){
+        return false;
+    }
+    int v = 0;
+    for (; i < len; i++){
+        if (str[i] < '0' || str[i] > '9'){
+            return false;
+        }
+        v = v * 10 + (str[i] - '0');
+    }
+    *value = negative ? -v : v;
+    return true;
 }
-void MitsuProtocol::wideVane_tFromString (const char* wideVaneStr, wideVane_t* wideVane, bool success){
-    success=true;
-    if(strcmp(wideVaneStr,"full_left")==0){ *wideVane= wideVane_t::wideVaneFullLeft;}
-    else if(strcmp(wideVaneStr, "half_left")==0){ *wideVane= wideVane_t::wideVaneHalfLeft;}
-    else if(strcmp(wideVaneStr, "center")==0){ *wideVane= wideVane_t::wideVaneCenter;}
-    else if(strcmp(wideVaneStr, "half_right")==0){ *wideVane= wideVane_t::wideVaneHalfRight;}
-    else if(strcmp(wideVaneStr, "full_right")==0){ *wideVane= wideVane_t::wideVaneFullRight;}
-    else if(strcmp(wideVaneStr, "left_and_right")==0){ *wideVane= wideVane_t::wideVaneLeftAndRight;}
-    else if(strcmp(wideVaneStr, "swing")==0){ *wideVane= wideVane_t::wideVaneSwing;}
-    else{*wideVane=wideVane_t::wideVaneCenter;success=false;}
+
+bool MitsuProtocol::settingsFromJson (const char* json, settings_t* settings){
+    *settings = emptySettings;
+
+    const char* p = json;
+    skipSpace(p);
+    if (*p++ != '{'){
+        return false;
+    }
+    skipSpace(p);
+    if (*p == '}'){
+        p++;
+    }else{
+        while (true){
+            const char* key;
+            size_t keyLen;
+            const char* value;
+            size_t valueLen;
+            bool escaped;
+            bool isString;
+
+            skipSpace(p);
+            if (!scanString(p, &key, &keyLen, &escaped)){
+                return false;
+            }
+            skipSpace(p);
+            if (*p++ != ':'){
+                return false;
+            }
+            skipSpace(p);
+            isString = (*p == '"');
+            if (isString){
+                if (!scanString(p, &value, &valueLen, &escaped)){
+                    return false;
+                }
+            }else if (*p == '{' || *p == '['){
+                if (!scanNested(p, &value, &valueLen)){
+                    return false;
+                }
+            }else if (!scanScalar(p, &value, &valueLen)){
+                return false;
+            }
+
+            for (size_t k = 0; k < sizeof(jsonKeys) / sizeof(jsonKeys[0]); k++){
+                const jsonKey_t& jk = jsonKeys[k];
+                if (jk.len != keyLen || memcmp(jk.name, key, keyLen) != 0){
+                    continue;
+                }
+                uint8_t code = 0;
+                int temp = 0;
+                if (jk.table){
+                    if (!isString || escaped || !fromString(*jk.table, value, valueLen, &code)){
+                        return false;
+                    }
+                }else if (isString || !parseInt(value, valueLen, &temp) || temp < 16 || temp > 31){
+                    return false;
+                }
+                switch (jk.control){
+                    case control_t::power:    settings->power = static_cast<power_t>(code);       break;
+                    case control_t::mode:     settings->mode = static_cast<mode_t>(code);         break;
+                    case control_t::fan:      settings->fan = static_cast<fan_t>(code);           break;
+                    case control_t::vane:     settings->vane = static_cast<vane_t>(code);         break;
+                    case control_t::wideVane: settings->wideVane = static_cast<wideVane_t>(code); break;
+                    case control_t::temp:     settings->tempDegC = static_cast<int8_t>(temp);     break;
+                }
+                settings->valid |= jk.control;
+                break;
+            }
+
+            skipSpace(p);
+            if (*p == ','){
+                p++;
+            }else if (*p == '}'){
+                p++;
+                break;
+            }else{
+                return false;
+            }
+        }
+    }
+    skipSpace(p);
+    return (*p == '\0');
 }
 
 /* packetBuilder */
 
 MitsuProtocol::packetBuilder::packetBuilder(MitsuProtocol* parent) {
     this->parent = parent;
-    cursor = 0;
-    for (int i = 0; i < MAX_SIZE; i++){
-        buffer[i] = 0;
-    }
+    reset();
+    resetStats();
+}
+
+const MitsuProtocol::packetBuilder::stats_t& MitsuProtocol::packetBuilder::getStats(){
+    return stats;
+}
+
+void MitsuProtocol::packetBuilder::resetStats(){
+    memset(&stats, 0, sizeof(stats));
 }
 
 int MitsuProtocol::packetBuilder::addByte(uint8_t b){
-    #ifdef DEBUG_BYTES
-    char dmsg[16];
-    strcpy (dmsg,"Rx: 0x");
-    char dbuf[8];
-    strcat(dmsg, itoa(b,dbuf,16));
-    parent->log(dmsg);    
-    #endif
-      
-    // Too many bytes, reset
-    if (cursor >= MAX_SIZE){
-        #ifdef DEBUG_BYTES
-        parent->log("MitsuProtocol::packetBuilder.addByte: cursor reset");        
-        #endif
-        reset();
-    }
-
-    if ((cursor == 0 && b == HEADER_1) || cursor > 0){
-        #ifdef DEBUG_BYTES
-        if (cursor==0){
-            parent->log("MitsuProtocol::packetBuilder.addByte: packet start");
+    // The last frame has been handled, move on to any bytes behind it
+    if (ready){
+        next();
+    }
+    ingest(b);
+
+    return (count == 0) ? 1 : 0; // 1: ignored - waiting for packet start
+}
+
+size_t MitsuProtocol::packetBuilder::addBytes(const uint8_t* data, size_t len, MitsuProtocol::msg_t* msgs,
+                                              size_t maxMsgs, size_t* consumed){
+    size_t found = 0;
+    size_t i = 0;
+
+    // Frames left over from a previous call that filled msgs
+    while (ready && found < maxMsgs){
+        msgs[found++] = getData();
+        next();
+    }
+
+    while (i < len && found < maxMsgs){
+        ingest(data[i++]);
+
+        while (ready && found < maxMsgs){
+            msgs[found++] = getData();
+            next();
+        }
+    }
+
+    if (consumed){
+        *consumed = i;
+    }
+    return found;
+}
+
+// Append a byte to the window and parse on, for addByte() and addBytes()
+void MitsuProtocol::packetBuilder::ingest(uint8_t b){
+    MITSU_TRACE_BYTE(MitsuTrace::rxByte, b);
+
+    // Can't happen while lengths are checked against MAX_SIZE, but never overrun
+    if (count >= MAX_SIZE){
+        MITSU_TRACE_EVENT(MitsuTrace::overflow, NULL, 0);
+        stats.overflows++;
+        resync();
+    }
+
+    stats.bytes++;
+    buffer[count] = b;
+    count++;
+    parse();
+}
+
+// Drop the frame just handled and parse whatever followed it
+void MitsuProtocol::packetBuilder::next(){
+    discard(frameLen);
+    parse();
+}
+
+void MitsuProtocol::packetBuilder::parse(){
+    while (!ready && cursor < count){
+        uint8_t b = buffer[cursor];
+
+        if (cursor == HEADER_1_POS && b != HEADER_1){
+            stats.bytesSkipped++;
+            resync();
+            continue;
+        }
+        if ((cursor == HEADER_3_POS && b != HEADER_3) ||
+            (cursor == HEADER_4_POS && b != HEADER_4)){
+            stats.headerResyncs++;
+            MITSU_TRACE_EVENT(MitsuTrace::resync, buffer, cursor + 1);
+            resync();
+            continue;
+        }
+
+        if (cursor == LENGTH_POS){
+            frameLen = HEADER_LEN + b + CHECKSUM_LEN;
+            if (frameLen > MAX_SIZE){
+                MITSU_TRACE_EVENT(MitsuTrace::badLength, buffer, cursor + 1);
+                stats.lengthErrors++;
+                resync();
+                continue;
+            }
+        }
+
+        if (frameLen > 0 && cursor == frameLen - 1){
+            if (b != ((0xfc - sum) & 0xff)){
+                MITSU_TRACE_EVENT(MitsuTrace::badChecksum, buffer, cursor + 1);
+                stats.checksumFailures++;
+                resync();
+                continue;
+            }
+            stats.frames[msgKindIndex(buffer[MSG_TYPE_POS])]++;
+            MITSU_TRACE_PACKET(MitsuTrace::rxFrame, buffer, frameLen);
+            ready = true;
+        }else{
+            sum += b;
         }
-        #endif
-        
-        buffer[cursor] = b;
         cursor++;
-        return 0; // OK, bytes accepted
-    }else{
-        return 1; // OK, but ignored - waiting for packet start
     }
 }
 
-bool MitsuProtocol::packetBuilder::complete(){
-    int expectedLength = MitsuProtocol::HEADER_LEN + buffer[MitsuProtocol::LENGTH_POS] + MitsuProtocol::CHECKSUM_LEN;
-    return (cursor >= expectedLength - 1);
+// Drop the current candidate and restart at the next header byte in the window
+void MitsuProtocol::packetBuilder::resync(){
+    int next = 1;
+    while (next < count && buffer[next] != HEADER_1){
+        next++;
+    }
+    discard(next);
 }
 
-bool MitsuProtocol::packetBuilder::valid(){
-    if (!complete()){
-        return false;
+void MitsuProtocol::packetBuilder::discard(int n){
+    if (n > count){
+        n = count;
     }
-    bool headerValid = (buffer[0] == MitsuProtocol::HEADER_1 &&
-                        buffer[2] == MitsuProtocol::HEADER_3 &&
-                        buffer[3] == MitsuProtocol::HEADER_4);
-                        
-    int checksumPos = MitsuProtocol::HEADER_LEN + buffer[MitsuProtocol::LENGTH_POS];
-    int numuint8_tsInMsg = MitsuProtocol::HEADER_LEN + buffer[MitsuProtocol::LENGTH_POS];
-    bool checksumValid = (buffer[checksumPos] == calculateChecksum (buffer,numuint8_tsInMsg));
+    memmove(buffer, buffer + n, count - n);
+    count -= n;
+    cursor = 0;
+    frameLen = 0;
+    sum = 0;
+    ready = false;
+}
 
-    return (headerValid && checksumValid);
+bool MitsuProtocol::packetBuilder::complete(){
+    return ready;
+}
+
+bool MitsuProtocol::packetBuilder::valid(){
+    // Frames are only completed once their header and checksum have passed
+    return ready;
 }
 
 MitsuProtocol::msg_t MitsuProtocol::packetBuilder::getData(){
-    #ifdef DEBUG_CALLS
-    parent->log("packetBuilder.getData()");
-    #endif
-    
-    #ifdef DEBUG_PACKETS
-    char dmsg[256];
-    strcpy (dmsg,"Rx Pkt: [");
-    for(int i = 0; i < 22; i++) {
-        strcat(dmsg,"0x");
-        char dbuf[8];
-        if (buffer[i]<=0x0f){strcat(dmsg,"0");}
-        strcat(dmsg, itoa(buffer[i],dbuf,16));
-        if (i==4){strcat(dmsg,"]");};
-        strcat(dmsg," ");
-    }
-    parent->log(dmsg);
-    #endif
 
         
     MitsuProtocol::msg_t msg;
@@ -335,9 +660,6 @@ MitsuProtocol::msg_t MitsuProtocol::packetBuilder::getData(){
     msg.msgKindValid = false;
     
     if (!valid()) {
-        #ifdef DEBUG_CALLS
-        parent->log("packetBuilder.getData: invalid");
-        #endif
         return msg;
     } //TBD
     
@@ -348,9 +670,6 @@ MitsuProtocol::msg_t MitsuProtocol::packetBuilder::getData(){
             break; // We don't care about these right now
             
         case msgKind_t::rxCurrentSettings:
-            #ifdef DEBUG_CALLS
-            parent->log("packetBuilder.getData: rxCurrentSettings");
-            #endif            
             msg.kind = MitsuProtocol::msgKind_t::rxCurrentSettings;
             msg.msgKindValid = true;
             msg.data.rxCurrentSettingsData.kind = static_cast<info_t>(buffer[DATA_KIND_POS]);
@@ -358,17 +677,12 @@ MitsuProtocol::msg_t MitsuProtocol::packetBuilder::getData(){
             switch (msg.data.rxCurrentSettingsData.kind){
                 case settings:
                     msg.data.rxCurrentSettingsData.data.settings.power = static_cast<power_t>(buffer[DATA_POWER_POS]);
-                    msg.data.rxCurrentSettingsData.data.settings.powerValid = true;
                     msg.data.rxCurrentSettingsData.data.settings.mode = static_cast<mode_t>(buffer[DATA_MODE_POS]);
-                    msg.data.rxCurrentSettingsData.data.settings.modeValid = true;
-                    msg.data.rxCurrentSettingsData.data.settings.tempDegC = byteToTemp(buffer[DATA_TEMP_POS]);    
-                    msg.data.rxCurrentSettingsData.data.settings.tempDegCValid = true;
+                    msg.data.rxCurrentSettingsData.data.settings.tempDegC = static_cast<int8_t>(byteToTemp(buffer[DATA_TEMP_POS]));    
                     msg.data.rxCurrentSettingsData.data.settings.fan = static_cast<fan_t>(buffer[DATA_FAN_POS]);
-                    msg.data.rxCurrentSettingsData.data.settings.fanValid = true;
                     msg.data.rxCurrentSettingsData.data.settings.vane = static_cast<vane_t>(buffer[DATA_VANE_POS]);
-                    msg.data.rxCurrentSettingsData.data.settings.vaneValid = true;
                     msg.data.rxCurrentSettingsData.data.settings.wideVane = static_cast<wideVane_t>(buffer[DATA_WIDEVANE_POS]);
-                    msg.data.rxCurrentSettingsData.data.settings.wideVaneValid = true;
+                    msg.data.rxCurrentSettingsData.data.settings.valid = ALL_SETTINGS;
                     break;
                 case roomTemp:
                     msg.data.rxCurrentSettingsData.data.roomTemp.roomTemp = byteToRoomTemp(buffer[DATA_ROOM_TEMP_POS]);
@@ -376,58 +690,157 @@ MitsuProtocol::msg_t MitsuProtocol::packetBuilder::getData(){
                     msg.data.rxCurrentSettingsData.data.roomTemp.tempSens2Raw = byteToTempRaw(buffer[DATA_TEMP_SENS2_RAW]);
                     break;
                 default:
-                    #ifdef DEBUG_CALLS
-                    char dmsg[128];
-                    char dbuf[8];
-                    strcpy(dmsg,"packetBuilder.getData: unrecognised rx settings kind:");
-                    strcat(dmsg,itoa(buffer[MSG_TYPE_POS],dbuf,16));
-                    parent->log(dmsg);
-                    #endif    
                     break;
             }
             break;
         case msgKind_t::rxStatusOk:
-            #ifdef DEBUG_CALLS
-            char dmsg[128];
-            char dbuf[8];
-            strcpy(dmsg,"packetBuilder.getData: rxStatusOk");
-            strcat(dmsg,itoa(buffer[MSG_TYPE_POS],dbuf,16));
-            parent->log(dmsg);            
-            #endif        
             msg.kind = MitsuProtocol::msgKind_t::rxStatusOk;
             msg.msgKindValid = true;
             break;
         case msgKind_t::rxStatusNok:
-            #ifdef DEBUG_CALLS
-            char dmsg2[128];
-            char dbuf2[8];
-            strcpy(dmsg2,"packetBuilder.getData: rxStatusNok");
-            strcat(dmsg2,itoa(buffer[MSG_TYPE_POS],dbuf2,16));
-            parent->log(dmsg2);            
-            #endif
                  
             msg.kind = MitsuProtocol::msgKind_t::rxStatusNok;
             msg.msgKindValid = true;
             break;
-        default:       
-            #ifdef DEBUG_CALLS
-            char dmsg3[128];
-            char dbuf3[8];
-            strcpy(dmsg3,"packetBuilder.getData: unrecognised message type:");
-            strcat(dmsg3,itoa(buffer[MSG_TYPE_POS],dbuf3,16));
-            parent->log(dmsg3);            
-            #endif
+        default:
+            MITSU_TRACE_EVENT(MitsuTrace::unknownMsg, buffer, frameLen);
             break; // Unrecognised message
     }
     return msg;
 }
 
 void MitsuProtocol::packetBuilder::reset(){
-    #ifdef DEBUG_CALLS
-    parent->log("packetBuilder.getData: reset()");
-    #endif
-    cursor = 0;
-    for (int i; i < MAX_SIZE; i++){
+    count = 0;
+    discard(0);
+    for (int i = 0; i < MAX_SIZE; i++){
         buffer[i] = 0;
     }
 }
+
+/* jsonWriter */
+
+MitsuProtocol::jsonWriter::jsonWriter(char* buffer, size_t capacity) {
+    this->buffer = buffer;
+    this->capacity = capacity;
+    len = 0;
+    overflow = (capacity == 0);
+    needComma = false;
+}
+
+void MitsuProtocol::jsonWriter::put(char c){
+    // Always leave room for the terminator
+    if (len + 1 < capacity){
+        buffer[len++] = c;
+    }else{
+        overflow = true;
+    }
+}
+
+void MitsuProtocol::jsonWriter::put(const char* str){
+    while (*str){
+        put(*str++);
+    }
+}
+
+void MitsuProtocol::jsonWriter::separate(){
+    if (needComma){
+        put(',');
+    }
+    needComma = true;
+}
+
+void MitsuProtocol::jsonWriter::beginObject(){
+    separate();
+    put('{');
+    needComma = false;
+}
+
+void MitsuProtocol::jsonWriter::endObject(){
+    put('}');
+    needComma = true;
+}
+
+void MitsuProtocol::jsonWriter::beginArray(){
+    separate();
+    put('[');
+    needComma = false;
+}
+
+void MitsuProtocol::jsonWriter::endArray(){
+    put(']');
+    needComma = true;
+}
+
+void MitsuProtocol::jsonWriter::key(const char* name){
+    separate();
+    put('"');
+    put(name);
+    put('"');
+    put(':');
+    needComma = false;
+}
+
+void MitsuProtocol::jsonWriter::string(const char* value){
+    separate();
+    put('"');
+    for (; *value; value++){
+        if (*value == '"' || *value == '\\'){
+            put('\\');
+        }
+        put(*value);
+    }
+    put('"');
+}
+
+void MitsuProtocol::jsonWriter::integer(long value){
+    digits((value < 0) ? 0UL - (unsigned long)value : (unsigned long)value, value < 0);
+}
+
+void MitsuProtocol::jsonWriter::integer(unsigned long value){
+    digits(value, false);
+}
+
+void MitsuProtocol::jsonWriter::digits(unsigned long value, bool negative){
+    char buf[3 * sizeof(unsigned long) + 1]; // Every 8 bits take under 3 digits
+    int n = 0;
+    do {
+        buf[n++] = '0' + (value % 10);
+        value /= 10;
+    } while (value);
+
+    separate();
+    if (negative){
+        put('-');
+    }
+    while (n){
+        put(buf[--n]);
+    }
+}
+
+void MitsuProtocol::jsonWriter::fixed1(double value){
+    long tenths = (value < 0) ? -(long)(-value * 10 + 0.5) : (long)(value * 10 + 0.5);
+    long whole = tenths / 10;
+    int frac = (int)(tenths % 10);
+
+    if (tenths < 0 && whole == 0){
+        // integer() can't show -0
+        separate();
+        put('-');
+        put('0');
+    }else{
+        integer(whole);
+    }
+    put('.');
+    put('0' + (frac < 0 ? -frac : frac));
+}
+
+size_t MitsuProtocol::jsonWriter::finish(){
+    if (overflow){
+        if (capacity > 0){
+            buffer[0] = '\0';
+        }
+        return 0;
+    }
+    buffer[len] = '\0';
+    return len;
+}
@@ -17,31 +17,19 @@
   License along with this library; if not, write to the Free Software
   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 */
-#ifdef ESP8266
+#ifndef __MitsuProtocol_H__
+#define __MitsuProtocol_H__
+#include <stdint.h>
+#include <stddef.h>
+#if defined(ESP8266) || !defined(ARDUINO)
 #include <functional>
 #endif
-
-// Debug
-#define DEBUG_ON
-#define DEBUG_PACKETS
-//#define DEBUG_CALLS
-//#define DEBUG_BYTES
-
-
-#ifdef DEBUG_ON
-#define DEBUG_CB std::function<void(const char* msg)> debugCb
-#else
-#define DEBUG_CB void (*debugCb)();
-#endif
+#include "MitsuTrace.h"
 
 
 class MitsuProtocol
 {
 public:
-    #ifdef DEBUG_ON
-    void setDebugCb(DEBUG_CB);
-    #endif
-    
 	/* TYPES */
 	
     enum class power_t : uint8_t
@@ -93,47 +81,67 @@ public:
     };
   
 
-    // Main settings type
+    // Main settings type, valid holds the control_t bits of the fields
+    // that are set so a settings frame's control byte falls out of it
     struct settings_t {
        power_t power;
-       bool powerValid;
        mode_t mode;
-       bool modeValid;
        fan_t fan;
-       bool fanValid;
        vane_t vane;
-       bool vaneValid;
        wideVane_t wideVane;
-       bool wideVaneValid;
-       int tempDegC;
-       bool tempDegCValid;  
+       int8_t tempDegC;
+       uint8_t valid;
     };
-    
-    bool equals(settings_t left, settings_t right){
-        bool result = true;
-        result &= ((left.powerValid && right.powerValid) ? (left.power == right.power) : true);
-        result &= ((left.modeValid && right.modeValid) ? (left.mode == right.mode) : true);
-        result &= ((left.fanValid && right.fanValid) ? (left.fan == right.fan) : true);
-        result &= ((left.vaneValid && right.vaneValid) ? (left.vane == right.vane) : true);
-        result &= ((left.wideVaneValid && right.wideVaneValid) ? (left.wideVane == right.wideVane) : true);
-        result &= ((left.tempDegCValid && right.tempDegCValid) ? (left.tempDegC == right.tempDegC) : true);
-        return result;
+
+    // control_t bits of the fields valid in both that differ
+    static uint8_t diff(const settings_t& left, const settings_t& right){
+        uint8_t result = 0;
+        result |= (left.power != right.power) ? control_t::power : 0;
+        result |= (left.mode != right.mode) ? control_t::mode : 0;
+        result |= (left.tempDegC != right.tempDegC) ? control_t::temp : 0;
+        result |= (left.fan != right.fan) ? control_t::fan : 0;
+        result |= (left.vane != right.vane) ? control_t::vane : 0;
+        result |= (left.wideVane != right.wideVane) ? control_t::wideVane : 0;
+        return result & left.valid & right.valid;
+    }
+
+    // Whether the fields valid in both match
+    static bool equals(const settings_t& left, const settings_t& right){
+        return diff(left, right) == 0;
+    }
+
+    // The control byte that takes a unit at current to target: the fields
+    // valid in target that current doesn't know or has different
+    static uint8_t controlFor(const settings_t& target, const settings_t& current){
+        uint8_t known = target.valid & current.valid;
+        return (target.valid & ~known) | diff(target, current);
+    }
+
+    // Copy the valid fields of from over into
+    static void merge(settings_t* into, const settings_t& from){
+        if (from.valid & control_t::power){ into->power = from.power; }
+        if (from.valid & control_t::mode){ into->mode = from.mode; }
+        if (from.valid & control_t::temp){ into->tempDegC = from.tempDegC; }
+        if (from.valid & control_t::fan){ into->fan = from.fan; }
+        if (from.valid & control_t::vane){ into->vane = from.vane; }
+        if (from.valid & control_t::wideVane){ into->wideVane = from.wideVane; }
+        into->valid |= from.valid;
     }
        
-    const settings_t emptySettings = {MitsuProtocol::power_t::powerOff,false,
-                                      MitsuProtocol::mode_t::modeFan,false,
-                                      MitsuProtocol::fan_t::fan1,false,
-                                      MitsuProtocol::vane_t::vane1,false,
-                                      MitsuProtocol::wideVane_t::wideVaneCenter,false,
-                                      0,false}; 
+    static constexpr settings_t emptySettings = {MitsuProtocol::power_t::powerOff,
+                                                 MitsuProtocol::mode_t::modeFan,
+                                                 MitsuProtocol::fan_t::fan1,
+                                                 MitsuProtocol::vane_t::vane1,
+                                                 MitsuProtocol::wideVane_t::wideVaneCenter,
+                                                 0, 0};
                                               
 
     struct roomTemp_t {
+       double tempSens1Raw;
+       double tempSens2Raw;
        int roomTemp;
        bool roomTempValid;
-       double tempSens1Raw;
        bool tempSens1RawValid;
-       double tempSens2Raw;
        bool tempSens2RawValid;       
     };    
     
@@ -183,6 +191,7 @@ public:
         vane     = 0x10,
         wideVane = 0x80
     };
+    static const uint8_t ALL_SETTINGS = power | mode | temp | fan | vane | wideVane;
 
     struct msg_t
     {
@@ -204,54 +213,163 @@ public:
     // Constructor
     MitsuProtocol();
 	
-	 // String conversions
-	 const char* power_tToString (power_t power);
-    void power_tFromString (const char* powerStr, power_t* power, bool success);
-    const char* mode_tToString (mode_t mode);
-    void mode_tFromString (const char* modeStr, mode_t* mode, bool success);
-    const char* fan_tToString (fan_t fan);
-    void fan_tFromString (const char* fanStr, fan_t* fan, bool success);
-    const char* vane_tToString (vane_t vane); 
-    void vane_tFromString (const char* vaneStr, vane_t* vane, bool success); 
-    const char* wideVane_tToString (wideVane_t wideVane);
-    void wideVane_tFromString (const char* wideVaneStr, wideVane_t* wideVane, bool success);
+	 // Name tables, one per enum, shared by every text encoding
+    struct enumName_t {
+        uint8_t value;
+        uint8_t len;
+        const char* name;
+    };
+    static const int ENUM_SLOTS = 16;
+    struct enumTable_t {
+        const enumName_t* names;
+        uint8_t count;
+        const uint8_t* slots; // ENUM_SLOTS indexes into names, see fromString()
+    };
+    static const enumTable_t powerTable;
+    static const enumTable_t modeTable;
+    static const enumTable_t fanTable;
+    static const enumTable_t vaneTable;
+    static const enumTable_t wideVaneTable;
+
+    // Table lookups, str need not be terminated
+    static const char* toString (const enumTable_t& table, uint8_t value);
+    static bool fromString (const enumTable_t& table, const char* str, size_t len, uint8_t* value);
+
+	 // String conversions, success is false and a default set if str is unknown
+	 static const char* power_tToString (power_t power);
+    static void power_tFromString (const char* powerStr, power_t* power, bool& success);
+    static const char* mode_tToString (mode_t mode);
+    static void mode_tFromString (const char* modeStr, mode_t* mode, bool& success);
+    static const char* fan_tToString (fan_t fan);
+    static void fan_tFromString (const char* fanStr, fan_t* fan, bool& success);
+    static const char* vane_tToString (vane_t vane); 
+    static void vane_tFromString (const char* vaneStr, vane_t* vane, bool& success); 
+    static const char* wideVane_tToString (wideVane_t wideVane);
+    static void wideVane_tFromString (const char* wideVaneStr, wideVane_t* wideVane, bool& success);
   
+    // Parse a json command ({"pwr":"on","stemp":22,...}) in place. Keys
+    // that are left out are left invalid in settings, unknown keys are
+    // skipped whatever their value (objects and arrays up to 8 deep).
+    // False if the json is malformed or a value is unknown.
+    bool settingsFromJson (const char* json, settings_t* settings);
+
+    // Message kinds as a dense index (the last is any unknown kind), for counting
+    static const int MSG_KIND_COUNT = 7;
+    static int msgKindIndex (uint8_t kind);
+    static const char* msgKindName (int index);
+
     // Tx Packet Get Methods
-    int getTxSettingsPacket (uint8_t* buffer, settings_t settings);
+    int getTxSettingsPacket (uint8_t* buffer, const settings_t& settings);
+    // Only the fields of settings that differ from, or aren't known in,
+    // current. Returns 0 and leaves buffer alone if there are none
+    int getTxSettingsPacket (uint8_t* buffer, const settings_t& settings, const settings_t& current);
     int getTxConnectPacket (uint8_t* buffer);
     int getTxInfoPacket (uint8_t* buffer, info_t kind);
+
+    // Calculate the checksum for given uint8_ts.
+    static uint8_t calculateChecksum(const uint8_t* data, int len);
 	
     /* 
     packetBuilder Class -
     Add one byte at a time and discover when a valid
     packet is detected and then get the data.
+    Bytes are held in a sliding window; a candidate frame with a bad
+    header, impossible length or bad checksum is dropped and the window
+    rescanned from the next header byte, so a corrupted frame never
+    costs the frame behind it. A complete frame is discarded by the
+    next addByte(), reset() is only needed to drop everything.
     */
     class packetBuilder
     {
         friend class MitsuProtocol;
         
         public:
+            // Shortest possible frame, HEADER_LEN + CHECKSUM_LEN
+            static const int MIN_PACKET_LEN = 6;
+
+            // Counters, since construction or resetStats()
+            struct stats_t {
+                uint32_t bytes;            // Bytes added
+                uint32_t bytesSkipped;     // Bytes outside any frame
+                uint32_t headerResyncs;    // Frames dropped for a bad header
+                uint32_t lengthErrors;     // Frames dropped for an impossible length
+                uint32_t checksumFailures; // Frames dropped for a bad checksum
+                uint32_t overflows;        // Window full
+                uint32_t frames[MSG_KIND_COUNT]; // Good frames, by msgKindIndex()
+            };
+
             packetBuilder(MitsuProtocol* parent);
+            const stats_t& getStats();
+            void resetStats();
             int addByte(uint8_t b);
+            // Add a chunk of bytes and get every frame decoded from it.
+            // Stops early if msgs fills up, the bytes used are returned
+            // in consumed. Don't mix with addByte()/complete() polling.
+            size_t addBytes(const uint8_t* data, size_t len, MitsuProtocol::msg_t* msgs,
+                            size_t maxMsgs, size_t* consumed = NULL);
             bool complete();
             bool valid();
             MitsuProtocol::msg_t getData();
             void reset();
             
         private:
+            void ingest(uint8_t b);
+            void next();
+            void parse();
+            void resync();
+            void discard(int n);
+
             MitsuProtocol* parent;
             static const int MAX_SIZE=32;
             uint8_t buffer[MAX_SIZE];
-            int cursor;
+            int count;    // Bytes held in the window
+            int cursor;   // Bytes of the window parsed as the current frame
+            int frameLen; // Length of the current frame, 0 until known
+            uint8_t sum;  // Running sum of the current frame, excluding checksum
+            bool ready;   // Current frame is complete and its checksum passed
+            stats_t stats;
+    };
+
+    /* 
+    jsonWriter Class -
+    Writes json into a fixed buffer in one pass, keeping the length
+    as it goes so nothing is rescanned. Commas are placed automatically.
+    If anything doesn't fit, finish() returns 0 and leaves an empty string.
+    */
+    class jsonWriter
+    {
+        public:
+            jsonWriter(char* buffer, size_t capacity);
+            void beginObject();
+            void endObject();
+            void beginArray();
+            void endArray();
+            void key(const char* name);
+            void string(const char* value);
+            void integer(long value);
+            void integer(unsigned long value); // Counters past LONG_MAX stay positive
+            void integer(int value){ integer(static_cast<long>(value)); }
+            void integer(unsigned int value){ integer(static_cast<unsigned long>(value)); }
+            void fixed1(double value); // One decimal place
+            size_t finish();
+
+        private:
+            void put(char c);
+            void put(const char* str);
+            void separate();
+            void digits(unsigned long value, bool negative);
+
+            char* buffer;
+            size_t capacity;
+            size_t len;
+            bool overflow;
+            bool needComma;
     };
-	
 	
 private:
-    #ifdef DEBUG_ON
-    DEBUG_CB;
-    void log (const char* msg);
-    #endif
-    
+    // A settings frame setting the fields of settings in control
+    int settingsPacket (uint8_t* buffer, const settings_t& settings, uint8_t control);
+
     /* 
     The temperatures uint8_t values are a constant offset from the
     degrees Celsius value. These routines check the range and
@@ -273,9 +391,6 @@ private:
         return ((static_cast<double>(b) - static_cast<double>(128))/static_cast<double>(2));
     }
     
-    // Calculate the checksum for given uint8_ts.
-    static uint8_t calculateChecksum(uint8_t* data, int len);
-    
     /* Constants */
     
     // All Packets
@@ -331,3 +446,4 @@ private:
     static const int CONNECT_2 = 0x01; // seems to be constant
     
 };
+#endif
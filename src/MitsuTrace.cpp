@@ -0,0 +1,146 @@
+/*
+  MitsuTrace.cpp - Mitsubishi Air Conditioner/Heat Pump protocol library
+  Copyright (c) 2017 Jarrod Lamb.  All right reserved.
+  Originally reverse engineered by Hadley Rich (http://nice.net.nz)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include <string.h>
+#include "Arduino.h"
+#include "MitsuTrace.h"
+
+#if (MITSU_TRACE_RING_SIZE & (MITSU_TRACE_RING_SIZE - 1)) != 0
+#error "MITSU_TRACE_RING_SIZE must be a power of two"
+#endif
+
+static const char* const eventNames[] = {
+    "rx", "tx", "rx byte", "resync", "bad length", "bad checksum", "overflow",
+    "unknown msg", "tx dropped", "retry", "timeout", "reinit", "retransmit",
+    "settings nok"
+};
+
+// The ring and its clock only exist when tracing is built in
+#if MITSU_TRACE_LEVEL > MITSU_TRACE_OFF
+static const uint16_t RING_MASK = MITSU_TRACE_RING_SIZE - 1;
+
+static MitsuTrace::record_t ring[MITSU_TRACE_RING_SIZE];
+static unsigned long droppedRecords = 0;
+static MitsuTrace::clockFn_t traceClock = millis;
+
+// head is only written by the producer and tail by the consumer
+#if defined(ESP8266) || !defined(ARDUINO)
+static std::atomic<uint16_t> head(0);
+static std::atomic<uint16_t> tail(0);
+static inline uint16_t loadAcquire(std::atomic<uint16_t>& i){ return i.load(std::memory_order_acquire); }
+static inline void storeRelease(std::atomic<uint16_t>& i, uint16_t v){ i.store(v, std::memory_order_release); }
+#else
+static volatile uint16_t head = 0;
+static volatile uint16_t tail = 0;
+static inline uint16_t loadAcquire(volatile uint16_t& i){ return i; }
+static inline void storeRelease(volatile uint16_t& i, uint16_t v){ i = v; }
+#endif
+
+void MitsuTrace::setClock(clockFn_t clock){
+    traceClock = clock;
+}
+
+void MitsuTrace::record(event_t event, const uint8_t* data, size_t len){
+    uint16_t h = loadAcquire(head);
+    if ((uint16_t)(h - loadAcquire(tail)) >= MITSU_TRACE_RING_SIZE){
+        droppedRecords++;
+        return;
+    }
+    record_t& rec = ring[h & RING_MASK];
+    rec.timeMs = traceClock();
+    rec.event = static_cast<uint8_t>(event);
+    rec.len = (len > MAX_DATA_LEN) ? MAX_DATA_LEN : static_cast<uint8_t>(len);
+    if (rec.len){
+        memcpy(rec.data, data, rec.len);
+    }
+    storeRelease(head, h + 1);
+}
+
+bool MitsuTrace::pop(record_t* rec){
+    uint16_t t = loadAcquire(tail);
+    if (t == loadAcquire(head)){
+        return false;
+    }
+    *rec = ring[t & RING_MASK];
+    storeRelease(tail, t + 1);
+    return true;
+}
+
+unsigned long MitsuTrace::dropped(){
+    return droppedRecords;
+}
+
+size_t MitsuTrace::drain(TRACE_CB){
+    record_t rec;
+    char msg[16 + 16 + 3 * MAX_DATA_LEN + 4];
+    size_t n = 0;
+    while (pop(&rec)){
+        format(rec, msg, sizeof(msg));
+        if (traceCb){
+            traceCb(msg);
+        }
+        n++;
+    }
+    return n;
+}
+#endif
+
+const char* MitsuTrace::eventName(uint8_t event){
+    return (event < sizeof(eventNames) / sizeof(eventNames[0])) ? eventNames[event] : "?";
+}
+
+// "<ms> <event>: fc 62 01 30 10 | 02 00 ..." with a bar after the header
+size_t MitsuTrace::format(const record_t& rec, char* buf, size_t len){
+    static const char hex[] = "0123456789abcdef";
+    char digits[11];
+    int n = 0;
+    size_t pos = 0;
+    uint32_t t = rec.timeMs;
+
+    if (len == 0){
+        return 0;
+    }
+    do {
+        digits[n++] = '0' + (t % 10);
+        t /= 10;
+    } while (t);
+    while (n && pos + 1 < len){
+        buf[pos++] = digits[--n];
+    }
+    for (const char* p = " "; *p && pos + 1 < len; p++){
+        buf[pos++] = *p;
+    }
+    for (const char* p = eventName(rec.event); *p && pos + 1 < len; p++){
+        buf[pos++] = *p;
+    }
+    if (rec.len && pos + 1 < len){
+        buf[pos++] = ':';
+    }
+    for (int i = 0; i < rec.len && pos + 6 < len; i++){
+        buf[pos++] = ' ';
+        buf[pos++] = hex[rec.data[i] >> 4];
+        buf[pos++] = hex[rec.data[i] & 0x0f];
+        if (i == 4 && rec.len > 5){
+            buf[pos++] = ' ';
+            buf[pos++] = '|';
+        }
+    }
+    buf[pos] = '\0';
+    return pos;
+}
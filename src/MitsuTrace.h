@@ -0,0 +1,136 @@
+/*
+  MitsuTrace.h - Mitsubishi Air Conditioner/Heat Pump protocol library
+  Copyright (c) 2017 Jarrod Lamb.  All right reserved.
+  Originally reverse engineered by Hadley Rich (http://nice.net.nz)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef __MitsuTrace_H__
+#define __MitsuTrace_H__
+#include <stdint.h>
+#include <stddef.h>
+#if defined(ESP8266) || !defined(ARDUINO)
+#include <functional>
+#include <atomic>
+#endif
+
+// Trace levels, set MITSU_TRACE_LEVEL in the build flags. Anything above
+// the level compiles to nothing, the arguments are only named so they
+// don't warn as unused.
+#define MITSU_TRACE_OFF     0
+#define MITSU_TRACE_PACKETS 1 // Every frame in and out
+#define MITSU_TRACE_EVENTS  2 // Resyncs, retries, re-inits...
+#define MITSU_TRACE_BYTES   3 // Every byte received
+
+#ifndef MITSU_TRACE_LEVEL
+#define MITSU_TRACE_LEVEL MITSU_TRACE_OFF
+#endif
+
+// Records held before the oldest undrained are dropped, a power of two
+#ifndef MITSU_TRACE_RING_SIZE
+#define MITSU_TRACE_RING_SIZE 32
+#endif
+
+#if MITSU_TRACE_LEVEL >= MITSU_TRACE_PACKETS
+#define MITSU_TRACE_PACKET(event, data, len) MitsuTrace::record(event, data, len)
+#else
+#define MITSU_TRACE_PACKET(event, data, len) do { (void)(data); (void)(len); } while (0)
+#endif
+#if MITSU_TRACE_LEVEL >= MITSU_TRACE_EVENTS
+#define MITSU_TRACE_EVENT(event, data, len) MitsuTrace::record(event, data, len)
+#else
+#define MITSU_TRACE_EVENT(event, data, len) do { (void)(data); (void)(len); } while (0)
+#endif
+#if MITSU_TRACE_LEVEL >= MITSU_TRACE_BYTES
+#define MITSU_TRACE_BYTE(event, b) MitsuTrace::record(event, &(b), 1)
+#else
+#define MITSU_TRACE_BYTE(event, b) do { (void)(b); } while (0)
+#endif
+
+#if defined(ESP8266) || !defined(ARDUINO)
+#define TRACE_CB std::function<void(const char* msg)> traceCb
+#else
+#define TRACE_CB void (*traceCb)(const char* msg)
+#endif
+
+/*
+MitsuTrace Class -
+Fixed size binary trace records in a lock-free single producer, single
+consumer ring. The library only ever records (from its own loop); the
+application drains, which formats the records as text, whenever it
+suits, e.g. after its network work.
+There is one ring per program, so every controller must run on the same
+thread. Records are stamped with the clock of the controller last
+initialized, millis() before that.
+*/
+class MitsuTrace
+{
+public:
+    enum event_t {
+        rxFrame,      // data: the frame
+        txFrame,      // data: the frame
+        rxByte,       // data: the byte
+        resync,       // data: the dropped header bytes
+        badLength,    // data: the header
+        badChecksum,  // data: the frame
+        overflow,
+        unknownMsg,   // data: the frame
+        txDropped,    // data: the frame
+        retry,        // data: MitsuAc::request_t
+        timeout,      // data: MitsuAc::request_t
+        reinit,
+        retransmit,
+        settingsNok
+    };
+
+    static const int MAX_DATA_LEN = 22;
+
+    struct record_t {
+        uint32_t timeMs;
+        uint8_t event;
+        uint8_t len;
+        uint8_t data[MAX_DATA_LEN];
+    };
+
+    typedef unsigned long (*clockFn_t)();
+
+#if MITSU_TRACE_LEVEL > MITSU_TRACE_OFF
+    // Producer side, data beyond MAX_DATA_LEN is cut off
+    static void record(event_t event, const uint8_t* data, size_t len);
+
+    // Where record() gets the time from, MitsuAcT sets its Clock's now()
+    static void setClock(clockFn_t clock);
+
+    // Consumer side
+    static bool pop(record_t* rec);
+    static unsigned long dropped();
+
+    // Format and pass on every waiting record, returns the count
+    static size_t drain(TRACE_CB);
+#else
+    // Compiled out, there is no ring and never anything to drain
+    static void record(event_t, const uint8_t*, size_t){}
+    static void setClock(clockFn_t){}
+    static bool pop(record_t*){ return false; }
+    static unsigned long dropped(){ return 0; }
+    static size_t drain(TRACE_CB){ (void)traceCb; return 0; }
+#endif
+
+    // Format a record as text, returns the length written
+    static size_t format(const record_t& rec, char* buf, size_t len);
+
+    static const char* eventName(uint8_t event);
+};
+#endif